@@ -1,28 +1,87 @@
 #include "dcpu.hpp"
 #include <string.h>
+#ifdef __linux__
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#endif
 #include <boost/phoenix/stl/algorithm/iteration.hpp>
 #include <boost/phoenix/object/delete.hpp>
 #include <boost/phoenix/core/argument.hpp>
 
+#define DCPU_MEMORY_BYTES (0x10000*sizeof(uint16_t))
+
+// Map a shared memory file twice in a row, so guest addresses up to 0x1ffff
+// alias the first 64K words. Returns NULL where that isn't possible.
+static uint16_t* mapMirroredMemory() {
+#if defined(__linux__) && defined(SYS_memfd_create)
+	int fd = syscall(SYS_memfd_create, "dcpu-memory", 0);
+	if(fd < 0) return NULL;
+	if(ftruncate(fd, DCPU_MEMORY_BYTES) != 0) {
+		close(fd);
+		return NULL;
+	}
+
+	// Reserve room for both views, then put the file over each half
+	uint8_t* base = (uint8_t*)mmap(NULL, 2*DCPU_MEMORY_BYTES, PROT_NONE,
+			MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if(base == MAP_FAILED) {
+		close(fd);
+		return NULL;
+	}
+	bool mapped = true;
+	for(int i=0;i < 2;i++) {
+		void* view = mmap(base + i*DCPU_MEMORY_BYTES, DCPU_MEMORY_BYTES,
+				PROT_READ | PROT_WRITE, MAP_SHARED | MAP_FIXED, fd, 0);
+		if(view == MAP_FAILED) mapped = false;
+	}
+	close(fd);
+	if(!mapped) {
+		munmap(base, 2*DCPU_MEMORY_BYTES);
+		return NULL;
+	}
+	return (uint16_t*)base;
+#else
+	return NULL;
+#endif
+}
+
 DCPUState::DCPUState() {
 	memset(&info, 0, sizeof(DCPURegisterInfo));
-	info.memory = (uint16_t*)malloc(0x10000*sizeof(uint16_t));
+	info.memory = mapMirroredMemory();
+	memoryMirrored = (info.memory != NULL);
+	if(!memoryMirrored)
+		info.memory = (uint16_t*)malloc(DCPU_MEMORY_BYTES);
 	elapsed = info.cycles = 0;
-	memset(info.memory, 0, 0x10000*sizeof(uint16_t));
+	memset(info.memory, 0, DCPU_MEMORY_BYTES);
 	info.statePtr = (void*)this;
 	ignited = isr = false;
+	interruptWaiting = false;
+
+	memset(codePages, 0, sizeof(codePages));
+	info.codePages = codePages;
+	codeWriteHandler = NULL;
+	codeWriteContext = NULL;
 }
 
 DCPUState::~DCPUState() {
 	boost::phoenix::for_each(hardware, (boost::phoenix::delete_(boost::phoenix::placeholders::_1)));
+#ifdef __linux__
+	if(memoryMirrored) {
+		munmap(info.memory, 2*DCPU_MEMORY_BYTES);
+		return;
+	}
+#endif
 	free(info.memory);
 }
 
-DCPUInsn DCPUState::decodeInsn() {
+// The original switch-based decoder, reading the instruction at pc in memory.
+// It's kept apart from DCPUState so the decode table can be built without one.
+static DCPUInsn decodeWords(const uint16_t* memory, uint16_t pc) {
 	DCPUInsn insn;
 	insn.cycleCost = 0;
-	insn.offset = info.pc;
-	uint16_t opc = getWord();
+	insn.offset = pc;
+	uint16_t opc = memory[pc++];
 	uint8_t baseOpcode = (opc & 0x1f);
 	uint8_t fieldA = (opc & 0xfc00) >> 10;
 	uint8_t fieldB = (opc & 0x03e0) >> 5;
@@ -63,7 +122,7 @@ DCPUInsn DCPUState::decodeInsn() {
 		case 0x17:
 			insn.a.val = DCPUValue::VT_INDIRECT_REGISTER_OFFSET;
 			insn.a.reg = (DCPUValue::Register)(fieldA-0x10);
-			insn.a.nextWord = getWord();
+			insn.a.nextWord = memory[pc++];
 			insn.cycleCost++; // 1-cycle cost for memory access
 			break;
 		case 0x18:
@@ -74,7 +133,7 @@ DCPUInsn DCPUState::decodeInsn() {
 			break;
 		case 0x1a:
 			insn.a.val = DCPUValue::VT_PICK;
-			insn.a.nextWord = getWord();
+			insn.a.nextWord = memory[pc++];
 			break;
 		case 0x1b:
 			insn.a.val = DCPUValue::VT_SP;
@@ -88,12 +147,12 @@ DCPUInsn DCPUState::decodeInsn() {
 		case 0x1e:
 			insn.a.val = DCPUValue::VT_MEMORY;
 			insn.cycleCost++;
-			insn.a.nextWord = getWord();
+			insn.a.nextWord = memory[pc++];
 			break;
 		case 0x1f:
 			insn.a.val = DCPUValue::VT_LITERAL;
 			insn.cycleCost++;
-			insn.a.nextWord = getWord();
+			insn.a.nextWord = memory[pc++];
 			break;
 		default:
 			insn.a.val = DCPUValue::VT_LITERAL;
@@ -179,7 +238,7 @@ DCPUInsn DCPUState::decodeInsn() {
 			case 0x17:
 				insn.b.val = DCPUValue::VT_INDIRECT_REGISTER_OFFSET;
 				insn.b.reg = (DCPUValue::Register)(fieldB-0x10);
-				insn.b.nextWord = getWord();
+				insn.b.nextWord = memory[pc++];
 				insn.cycleCost++; // 1-cycle cost for memory access
 				break;
 			case 0x18:
@@ -190,7 +249,7 @@ DCPUInsn DCPUState::decodeInsn() {
 				break;
 			case 0x1a:
 				insn.b.val = DCPUValue::VT_PICK;
-				insn.b.nextWord = getWord();
+				insn.b.nextWord = memory[pc++];
 				break;
 			case 0x1b:
 				insn.b.val = DCPUValue::VT_SP;
@@ -203,12 +262,12 @@ DCPUInsn DCPUState::decodeInsn() {
 				break;
 			case 0x1e:
 				insn.b.val = DCPUValue::VT_MEMORY;
-				insn.b.nextWord = getWord();
+				insn.b.nextWord = memory[pc++];
 				insn.cycleCost++;
 				break;
 			case 0x1f:
 				insn.b.val = DCPUValue::VT_LITERAL;
-				insn.b.nextWord = getWord();
+				insn.b.nextWord = memory[pc++];
 				insn.cycleCost++;
 				break;
 			default:
@@ -333,10 +392,201 @@ DCPUInsn DCPUState::decodeInsn() {
 		}
 	}
 
+	insn.nextOffset = pc;
+	return insn;
+}
+
+DCPUInsn DCPUState::decodeInsnReference() {
+	DCPUInsn insn = decodeWords(info.memory, info.pc);
+	info.pc = insn.nextOffset;
+	return insn;
+}
+
+// Decode table indexed by the first word of an instruction
+struct DCPUDecodeTable {
+	DCPUDecodeTable();
+
+	DCPUDecodeEntry entries[0x10000];
+};
+
+DCPUDecodeTable::DCPUDecodeTable() {
+	// Run the reference decoder over every word, twice with different words
+	// following it. Only an operand that takes the next word sees it change.
+	uint16_t words[3];
+	for(uint32_t w=0;w < 0x10000;w++) {
+		words[0] = (uint16_t)w;
+		words[1] = 0xbeef;
+		words[2] = 0;
+		uint16_t first = decodeWords(words, 0).a.nextWord;
+		words[1] = 0xcafe;
+		DCPUInsn insn = decodeWords(words, 0);
+
+		DCPUDecodeEntry& e = entries[w];
+		uint16_t extraWords = insn.nextOffset - insn.offset - 1;
+		bool aWord = (first == 0xbeef && insn.a.nextWord == 0xcafe);
+		e.op = insn.op;
+		e.cycleCost = insn.cycleCost;
+		e.flags = 0;
+		if(aWord) e.flags |= DCPU_DECODE_A_WORD;
+		if(extraWords > (aWord ? 1 : 0)) e.flags |= DCPU_DECODE_B_WORD;
+
+		e.aType = insn.a.val;
+		e.aReg = (insn.a.val <= DCPUValue::VT_INDIRECT_REGISTER_OFFSET) ? insn.a.reg : 0;
+		e.aLiteral = (insn.a.val == DCPUValue::VT_LITERAL && !aWord) ? (int8_t)insn.a.nextWord : 0;
+
+		// Special instructions don't have a b operand
+		if((w & 0x1f) == 0) {
+			e.bType = DCPUValue::VT_REGISTER;
+			e.bReg = 0;
+		} else {
+			e.bType = insn.b.val;
+			e.bReg = (insn.b.val <= DCPUValue::VT_INDIRECT_REGISTER_OFFSET) ? insn.b.reg : 0;
+		}
+	}
+}
+
+// Built the first time anything decodes, so decoding works from any static
+// initializer and binaries that never decode don't pay for it
+static const DCPUDecodeTable& decodeTable() {
+	static const DCPUDecodeTable table;
+	return table;
+}
+
+DCPUInsn DCPUState::decodeInsn() {
+	DCPUInsn insn;
+	insn.offset = info.pc;
+	const DCPUDecodeEntry& e = decodeTable().entries[getWord()];
+	insn.op = (DCPUOpcode)e.op;
+	insn.cycleCost = e.cycleCost;
+
+	insn.a.val = (DCPUValue::ValueType)e.aType;
+	insn.a.reg = (DCPUValue::Register)e.aReg;
+	insn.a.b = false;
+	insn.a.nextWord = (e.flags & DCPU_DECODE_A_WORD) ? getWord() : (uint16_t)e.aLiteral;
+
+	insn.b.val = (DCPUValue::ValueType)e.bType;
+	insn.b.reg = (DCPUValue::Register)e.bReg;
+	insn.b.b = true;
+	insn.b.nextWord = (e.flags & DCPU_DECODE_B_WORD) ? getWord() : 0;
+
 	insn.nextOffset = info.pc;
 	return insn;
 }
 
+bool DCPUState::memoryWritten(uint16_t addr, uint32_t len) {
+	if(codeWriteHandler == NULL || len == 0) return false;
+
+	// Only bother the handler if one of the written pages holds code
+	uint32_t first = addr >> DCPU_CODE_PAGE_SHIFT;
+	uint32_t last = ((uint32_t)addr + len - 1) >> DCPU_CODE_PAGE_SHIFT;
+	for(uint32_t p=first;p <= last;p++) {
+		if(codePages[p % DCPU_CODE_PAGES] == 0) continue;
+		if(codeWriteHandler(codeWriteContext, addr, len)) {
+			info.codeInvalidated = 1;
+			return true;
+		}
+		return false;
+	}
+	return false;
+}
+
+void DCPUState::triggerInterrupt(uint16_t message) {
+	// Nothing happens to interrupts raised while IA is zero
+	if(info.ia == 0) return;
+
+	if(!interruptQueue.push(message)) {
+		// Halt and Catch Fire
+		ignited = true;
+		return;
+	}
+	// Only counted once it can be popped, so a nonzero count always
+	// means there's something to take
+	__sync_fetch_and_add(&info.interruptsPending, 1);
+
+	// The add is a full barrier, so either the waiting thread sees the
+	// count, or it's already waiting to be woken here
+	if(interruptWaiting) {
+		boost::lock_guard<boost::mutex> lock(interruptWaitLock);
+		interruptArrived.notify_all();
+	}
+}
+
+bool DCPUState::waitForInterrupt(boost::chrono::high_resolution_clock::time_point deadline) {
+	boost::unique_lock<boost::mutex> lock(interruptWaitLock);
+	interruptWaiting = true;
+	__sync_synchronize();
+	while(info.interruptsPending == 0) {
+		if(interruptArrived.wait_until(lock, deadline) == boost::cv_status::timeout)
+			break;
+	}
+	interruptWaiting = false;
+	return info.interruptsPending != 0;
+}
+
+bool DCPUState::nextInterrupt(uint16_t& message) {
+	if(!interruptQueue.pop(message)) return false;
+	__sync_fetch_and_sub(&info.interruptsPending, 1);
+	return true;
+}
+
+bool DCPUState::pollInterrupts() {
+	// Interrupts raised while IA is zero are dropped
+	if(info.ia == 0) {
+		uint16_t message;
+		while(nextInterrupt(message));
+		return false;
+	}
+
+	// Leave them queued while a handler is running
+	if(info.queueInterrupts || info.interruptsPending == 0) return false;
+
+	// Mark the ISR flag, meaning that the JIT will handle the next
+	// interrupt once control gets back to it
+	isr = true;
+	return true;
+}
+
+DCPUInterruptQueue::DCPUInterruptQueue() : m_tail(0), m_head(0) {
+	for(uint32_t i=0;i < DCPU_INTERRUPT_QUEUE_SIZE;i++)
+		m_slots[i].sequence = i;
+}
+
+bool DCPUInterruptQueue::push(uint16_t message) {
+	uint32_t pos = m_tail;
+	Slot* slot;
+	while(true) {
+		slot = &m_slots[pos % DCPU_INTERRUPT_QUEUE_SIZE];
+		int32_t diff = (int32_t)(slot->sequence - pos);
+		if(diff == 0) {
+			// The slot is free, so try to claim the position
+			uint32_t seen = __sync_val_compare_and_swap(&m_tail, pos, pos+1);
+			if(seen == pos) break;
+			pos = seen;
+		} else if(diff < 0) {
+			// The slot still holds the message from a lap ago
+			return false;
+		} else {
+			// Another producer got here first
+			pos = m_tail;
+		}
+	}
+	slot->message = message;
+	__sync_synchronize();
+	slot->sequence = pos+1;
+	return true;
+}
+
+bool DCPUInterruptQueue::pop(uint16_t& message) {
+	Slot* slot = &m_slots[m_head % DCPU_INTERRUPT_QUEUE_SIZE];
+	if((int32_t)(slot->sequence - (m_head+1)) < 0) return false;
+	__sync_synchronize();
+	message = slot->message;
+	__sync_synchronize();
+	slot->sequence = m_head + DCPU_INTERRUPT_QUEUE_SIZE;
+	m_head++;
+	return true;
+}
+
 uint16_t DCPUState::getWord() {
 	return info.memory[info.pc++];
 }
@@ -3,8 +3,18 @@
 #include <stdint.h>
 #include <stdlib.h>
 #include <vector>
-#include <queue>
-#include <boost/thread.hpp>
+#include <boost/chrono.hpp>
+#include <boost/thread/mutex.hpp>
+#include <boost/thread/condition_variable.hpp>
+
+// Guest memory is divided into pages of (1 << DCPU_CODE_PAGE_SHIFT) words for
+// tracking which parts of it translated code was generated from
+#define DCPU_CODE_PAGE_SHIFT 6
+#define DCPU_CODE_PAGES (0x10000 >> DCPU_CODE_PAGE_SHIFT)
+
+// Interrupts that can be queued at once. The spec sets the processor on fire
+// if more than this many pile up.
+#define DCPU_INTERRUPT_QUEUE_SIZE 256
 
 struct DCPUState;
 
@@ -46,6 +56,29 @@ struct DCPUInsn {
 	uint8_t cycleCost;
 };
 
+// How often the instruction at an address ran, and the cycles it took, when
+// profiling. A failed test's count includes the cycles skipping took.
+struct DCPUInsnCounts {
+	uint64_t executions;
+	uint64_t cycles;
+};
+
+// Flags for DCPUDecodeEntry
+#define DCPU_DECODE_A_WORD 0x01 // a takes the next word
+#define DCPU_DECODE_B_WORD 0x02 // b takes the word after a's, if any
+
+// Everything about an instruction that's determined by its first word. The
+// decoder looks these up in a table covering all 65536 words, which is built
+// from the reference decoder the first time an instruction is decoded.
+struct DCPUDecodeEntry {
+	uint8_t op;		// DCPUOpcode
+	uint8_t aType, bType;	// DCPUValue::ValueType
+	uint8_t aReg, bReg;
+	uint8_t flags;
+	uint8_t cycleCost;	// Including the cost of extra words
+	int8_t aLiteral;	// Value of an inline literal in a
+};
+
 struct DCPUHardwareInformation {
 	uint32_t hwID;
 	uint16_t hwRevision;
@@ -84,34 +117,102 @@ struct DCPURegisterInfo {
 	uint16_t *memory;			// Offset 0x20
 	uint8_t enableInterrupts;		// Offset 0x28 (pointers are 64-bit on x86-64)
 	uint8_t queueInterrupts;		// Offset 0x29 When active, disables calling the cycle hook
+	uint8_t codeInvalidated;		// Offset 0x2a Set when a write dropped a translation
+	uint8_t idle;				// Offset 0x2b Set when code skipped to the end of an idle loop
+	volatile uint32_t interruptsPending;	// Offset 0x2c Number of queued interrupts
 
 	// External state
 	void* statePtr;				// Offset 0x30
-} __attribute__((packed));
+	uint8_t *codePages;			// Offset 0x38 Points to DCPUState::codePages
+	void* const* jitTable;			// Offset 0x40 Addresses the generated code uses
+	uint8_t blockHot;			// Offset 0x48 Set when a block's execution counter ran out
+} __attribute__((packed, aligned(8)));
+
+// Bounded queue of interrupt messages. Any thread may push, but only the
+// thread running the processor may pop. Neither side ever blocks or locks.
+class DCPUInterruptQueue {
+public:
+	DCPUInterruptQueue();
+
+	// Returns false if the queue is full
+	bool push(uint16_t message);
+	// Returns false if the queue is empty
+	bool pop(uint16_t& message);
+
+private:
+	// A slot is free for the push at position n when its sequence is n, and
+	// holds a message for the pop at position n once it's n+1
+	struct Slot {
+		volatile uint32_t sequence;
+		uint16_t message;
+	};
+	Slot m_slots[DCPU_INTERRUPT_QUEUE_SIZE];
+	volatile uint32_t m_tail; // Position of the next push
+	uint32_t m_head; // Position of the next pop
+};
 
 // Full representation of the state of an emulated DCPU
 struct DCPUState {
 	DCPUState();
 	~DCPUState();
+	// Decode the instruction at PC and advance PC past it
 	DCPUInsn decodeInsn();
+	// The original switch-based decoder, which the decode table is built
+	// from. Gives the same results as decodeInsn.
+	DCPUInsn decodeInsnReference();
 	void loadFromFile(FILE* fptr, bool translate);
 	void writeToFile(FILE* fptr, bool translate);
 	uint16_t getWord();
 	uint16_t& operator[](uint16_t addr);
+
+	// Must be called by anything other than the generated code that stores
+	// into guest memory (hardware DMA, interrupt dispatch) so that stale
+	// translations of the written words are dropped. Returns true if any
+	// translation was invalidated.
+	bool memoryWritten(uint16_t addr, uint32_t len=1);
+
+	// Queue an interrupt, unless IA is zero. Safe to call from any thread.
+	// Overflowing the queue sets the processor on fire.
+	void triggerInterrupt(uint16_t message);
+	// Take the next queued interrupt, from the processor's thread only.
+	// Returns false if none are queued.
+	bool nextInterrupt(uint16_t& message);
+	// Check whether a queued interrupt can be taken now, and set isr if so.
+	// Interrupts queued while IA is zero are dropped here.
+	bool pollInterrupts();
+	// Block the processor's thread until an interrupt is queued or the
+	// deadline passes. Returns true if one is queued.
+	bool waitForInterrupt(boost::chrono::high_resolution_clock::time_point deadline);
 	
 	DCPURegisterInfo info;
+
+	// Set if info.memory is mapped twice, back to back, so the word at
+	// addr+0x10000 is the word at addr. Otherwise generated code has to
+	// wrap addresses itself.
+	bool memoryMirrored;
 	
-	// Interrupt queue
-	std::queue<uint16_t> interruptQueue;
+	// Interrupt queue. info.interruptsPending counts its entries.
+	DCPUInterruptQueue interruptQueue;
+	// Only used to wake the processor's thread while it waits for an
+	// interrupt, so queueing one doesn't lock otherwise
+	boost::mutex interruptWaitLock;
+	boost::condition_variable interruptArrived;
+	volatile bool interruptWaiting;
 	
 	// Hardware
 	std::vector<DCPUHardwareDevice*> hardware;
 	
 	// Threading and state tracking stuff
 	uint64_t elapsed; // Total elapsed cycles
-	bool ignited;
-	boost::mutex m_interruptMutex;
+	volatile bool ignited;
 
 	// Stuff that's used by the in-ASM callbacks to keep state
 	bool isr;
+
+	// Self-modifying code tracking. A nonzero entry marks a page that some
+	// translated block was decoded from. Writes to such pages are passed on
+	// to codeWriteHandler, which returns true if it dropped a translation.
+	uint8_t codePages[DCPU_CODE_PAGES];
+	bool (*codeWriteHandler)(void* ctx, uint16_t addr, uint32_t len);
+	void* codeWriteContext;
 };
@@ -45,9 +45,7 @@ DCPUHardwareInformation Clock::getInformation() {
 
 void Clock::runThread(atomic_time diff) {
 	while(message != 0) {
-		cpu->m_interruptMutex.lock();
-		cpu->interruptQueue.push(message);
-		cpu->m_interruptMutex.unlock();
+		cpu->triggerInterrupt(message);
 		boost::this_thread::sleep_for(diff);
 	}
 }
@@ -0,0 +1,290 @@
+#include "interp.hpp"
+
+// The word an operand refers to. Literals point at a copy of their value, so
+// stores to them are dropped like the spec asks.
+struct InterpOperand {
+	uint16_t* ptr;
+	bool memory;
+	uint16_t addr;
+	uint16_t literal;
+};
+
+// Resolve an operand, applying the stack pointer changes of PUSH and POP
+static void resolveOperand(DCPUState& st, const DCPUValue& v, InterpOperand& op) {
+	DCPURegisterInfo& info = st.info;
+	uint16_t* regs = &info.a;
+	op.memory = false;
+	switch(v.val) {
+		case DCPUValue::VT_REGISTER:
+			op.ptr = &regs[v.reg];
+			return;
+		case DCPUValue::VT_INDIRECT_REGISTER:
+			op.addr = regs[v.reg];
+			break;
+		case DCPUValue::VT_INDIRECT_REGISTER_OFFSET:
+			op.addr = regs[v.reg] + v.nextWord;
+			break;
+		case DCPUValue::VT_PUSHPOP:
+			op.addr = v.b ? --info.sp : info.sp++;
+			break;
+		case DCPUValue::VT_PEEK:
+			op.addr = info.sp;
+			break;
+		case DCPUValue::VT_PICK:
+			op.addr = info.sp + v.nextWord;
+			break;
+		case DCPUValue::VT_SP:
+			op.ptr = &info.sp;
+			return;
+		case DCPUValue::VT_PC:
+			op.ptr = &info.pc;
+			return;
+		case DCPUValue::VT_EX:
+			op.ptr = &info.ex;
+			return;
+		case DCPUValue::VT_MEMORY:
+			op.addr = v.nextWord;
+			break;
+		default:
+			op.literal = v.nextWord;
+			op.ptr = &op.literal;
+			return;
+	}
+	op.memory = true;
+	op.ptr = &info.memory[op.addr];
+}
+
+static void writeOperand(DCPUState& st, InterpOperand& op, uint16_t value) {
+	*op.ptr = value;
+	if(op.memory)
+		st.memoryWritten(op.addr);
+}
+
+static void push(DCPUState& st, uint16_t value) {
+	st.info.memory[--st.info.sp] = value;
+	st.memoryWritten(st.info.sp);
+}
+
+static uint16_t pop(DCPUState& st) {
+	return st.info.memory[st.info.sp++];
+}
+
+// Execute one of the special (single operand) instructions
+static void interpretSpecial(DCPUState& st, const DCPUInsn& inst) {
+	DCPURegisterInfo& info = st.info;
+	InterpOperand a;
+	resolveOperand(st, inst.a, a);
+	switch(inst.op) {
+		case DO_JSR:
+			push(st, info.pc);
+			info.pc = *a.ptr;
+			break;
+		case DO_INT:
+			st.triggerInterrupt(*a.ptr);
+			break;
+		case DO_IAG:
+			writeOperand(st, a, info.ia);
+			break;
+		case DO_IAS:
+			info.ia = *a.ptr;
+			break;
+		case DO_RFI:
+			info.queueInterrupts = 0;
+			info.a = pop(st);
+			info.pc = pop(st);
+			break;
+		case DO_IAQ:
+			info.queueInterrupts = (*a.ptr != 0);
+			break;
+		case DO_HWN:
+			writeOperand(st, a, st.hardware.size());
+			break;
+		case DO_HWQ: {
+			uint16_t n = *a.ptr;
+			if(n >= st.hardware.size()) break;
+			DCPUHardwareInformation hw = st.hardware[n]->getInformation();
+			info.a = hw.hwID & 0x0000FFFF;
+			info.b = (hw.hwID & 0xFFFF0000) >> 16;
+			info.c = hw.hwRevision;
+			info.x = hw.hwManufacturer & 0x0000FFFF;
+			info.y = (hw.hwManufacturer & 0xFFFF0000) >> 16;
+			}
+			break;
+		case DO_HWI: {
+			uint16_t n = *a.ptr;
+			if(n < st.hardware.size())
+				info.cycles -= st.hardware[n]->onInterrupt(&st);
+			}
+			break;
+		default:
+			break;
+	}
+}
+
+bool interpretInsn(DCPUState& st, const DCPUInsn& inst) {
+	DCPURegisterInfo& info = st.info;
+	info.cycles -= inst.cycleCost;
+	if(inst.op >= DO_JSR) {
+		interpretSpecial(st, inst);
+		return true;
+	}
+
+	// a is always resolved before b
+	InterpOperand a, b;
+	resolveOperand(st, inst.a, a);
+	resolveOperand(st, inst.b, b);
+	uint32_t av = *a.ptr, bv = *b.ptr;
+	int32_t as = (int16_t)av, bs = (int16_t)bv;
+	uint32_t result = 0;
+	int32_t ex = -1; // Stored after b, if set
+
+	switch(inst.op) {
+		case DO_SET:
+			result = av;
+			break;
+		case DO_ADD:
+			result = bv + av;
+			ex = (result > 0xffff) ? 1 : 0;
+			break;
+		case DO_SUB:
+			result = bv - av;
+			ex = (av > bv) ? 0xffff : 0;
+			break;
+		case DO_MUL:
+			result = bv * av;
+			ex = (uint16_t)(result >> 16);
+			break;
+		case DO_MLI:
+			result = (uint32_t)(bs * as);
+			ex = (uint16_t)(result >> 16);
+			break;
+		case DO_DIV:
+			if(av == 0) {
+				ex = 0;
+				break;
+			}
+			result = bv / av;
+			ex = (uint16_t)((bv << 16) / av);
+			break;
+		case DO_DVI:
+			if(as == 0) {
+				ex = 0;
+				break;
+			}
+			result = (uint32_t)(bs / as);
+			ex = (uint16_t)(((int64_t)bs << 16) / as);
+			break;
+		case DO_MOD:
+			if(av != 0) result = bv % av;
+			break;
+		case DO_MDI:
+			if(as != 0) result = (uint32_t)(bs % as);
+			break;
+		case DO_AND:
+			result = bv & av;
+			break;
+		case DO_BOR:
+			result = bv | av;
+			break;
+		case DO_XOR:
+			result = bv ^ av;
+			break;
+
+		// Shift counts are taken modulo 32, like the compiled code does
+		case DO_SHR: {
+			uint32_t shifted = (bv << 16) >> (av & 31);
+			result = shifted >> 16;
+			ex = (uint16_t)shifted;
+			}
+			break;
+		case DO_ASR:
+			result = (uint32_t)(bs >> (av & 31));
+			ex = (uint16_t)((int32_t)(bv << 16) >> (av & 31));
+			break;
+		case DO_SHL: {
+			uint32_t shifted = bv << (av & 31);
+			result = shifted;
+			ex = (uint16_t)(shifted >> 16);
+			}
+			break;
+
+		case DO_IFB:
+			return (bv & av) != 0;
+		case DO_IFC:
+			return (bv & av) == 0;
+		case DO_IFE:
+			return bv == av;
+		case DO_IFN:
+			return bv != av;
+		case DO_IFG:
+			return bv > av;
+		case DO_IFA:
+			return bs > as;
+		case DO_IFL:
+			return bv < av;
+		case DO_IFU:
+			return bs < as;
+
+		case DO_ADX:
+			result = bv + av + info.ex;
+			ex = (result > 0xffff) ? 1 : 0;
+			break;
+		case DO_SBX: {
+			int32_t wide = (int32_t)bv - (int32_t)av + (int32_t)info.ex;
+			result = (uint32_t)wide;
+			ex = (wide < 0) ? 0xffff : ((wide > 0xffff) ? 1 : 0);
+			}
+			break;
+		case DO_STI:
+		case DO_STD:
+			result = av;
+			break;
+		default:
+			return true;
+	}
+	writeOperand(st, b, result);
+	if(ex >= 0)
+		info.ex = ex;
+	if(inst.op == DO_STI) {
+		info.i++;
+		info.j++;
+	} else if(inst.op == DO_STD) {
+		info.i--;
+		info.j--;
+	}
+	return true;
+}
+
+void interpretBlock(DCPUState& st, const std::vector<DCPUInsn>& insns, bool pollEachInsn,
+		DCPUInsnCounts* counts) {
+	DCPURegisterInfo& info = st.info;
+	size_t n = 0;
+	while(n < insns.size() && insns[n].offset == info.pc) {
+		// Copied, since a store may free the block
+		DCPUInsn inst = insns[n];
+		if(pollEachInsn && info.interruptsPending != 0 && st.pollInterrupts())
+			return;
+		info.pc = inst.nextOffset;
+		bool passed = interpretInsn(st, inst);
+		if(counts != NULL) {
+			counts[inst.offset].executions++;
+			counts[inst.offset].cycles += inst.cycleCost;
+		}
+		if(info.codeInvalidated) return;
+		n++;
+
+		// A failed test skips the next instruction, and any further
+		// tests chained in front of it, at a cycle each
+		if(!passed) {
+			while(n < insns.size()) {
+				info.cycles--;
+				if(counts != NULL)
+					counts[inst.offset].cycles++;
+				info.pc = insns[n].nextOffset;
+				if(!(insns[n].op >= DO_IFB && insns[n].op <= DO_IFU)) break;
+				n++;
+			}
+			n++;
+		}
+	}
+}
@@ -0,0 +1,19 @@
+#pragma once
+#include <vector>
+#include "dcpu.hpp"
+
+// Execute a single decoded instruction against the state and charge its cycle
+// cost. PC has to point past the instruction already, and is changed if the
+// instruction writes it. Returns false if the instruction is a test that
+// failed, in which case the caller has to skip what follows it.
+bool interpretInsn(DCPUState& st, const DCPUInsn& inst);
+
+// Run the predecoded block in insns, which starts at the current PC, until
+// control leaves it. If pollEachInsn is set, interrupts are polled for before
+// every instruction, otherwise the caller polls on block entry. If counts
+// isn't NULL, every instruction run is counted in its entry.
+//
+// A store that invalidates translated code may free insns, so the block is
+// left right after any store that sets info.codeInvalidated.
+void interpretBlock(DCPUState& st, const std::vector<DCPUInsn>& insns, bool pollEachInsn,
+		DCPUInsnCounts* counts);
@@ -1,6 +1,13 @@
 #include "jit.hpp"
+#include "interp.hpp"
+#include "jitir.hpp"
+#include "jitcache.hpp"
 #include <vector>
+#include <set>
+#include <algorithm>
 #include <string.h>
+#include <stddef.h>
+#include <boost/static_assert.hpp>
 #ifdef WIN32
 #else
 #include <sys/mman.h>
@@ -11,6 +18,54 @@
 
 using namespace AsmJit;
 
+// The generated code addresses DCPURegisterInfo by hardcoded offsets
+BOOST_STATIC_ASSERT(offsetof(DCPURegisterInfo, cycles) == 0x18);
+BOOST_STATIC_ASSERT(offsetof(DCPURegisterInfo, memory) == 0x20);
+BOOST_STATIC_ASSERT(offsetof(DCPURegisterInfo, queueInterrupts) == 0x29);
+BOOST_STATIC_ASSERT(offsetof(DCPURegisterInfo, codeInvalidated) == 0x2a);
+BOOST_STATIC_ASSERT(offsetof(DCPURegisterInfo, idle) == 0x2b);
+BOOST_STATIC_ASSERT(offsetof(DCPURegisterInfo, interruptsPending) == 0x2c);
+BOOST_STATIC_ASSERT(offsetof(DCPURegisterInfo, statePtr) == 0x30);
+BOOST_STATIC_ASSERT(offsetof(DCPURegisterInfo, codePages) == 0x38);
+BOOST_STATIC_ASSERT(offsetof(DCPURegisterInfo, jitTable) == 0x40);
+BOOST_STATIC_ASSERT(offsetof(DCPURegisterInfo, blockHot) == 0x48);
+
+// Bump whenever the generated code, the dispatcher, or the helpers and jitTable
+// entries it calls change, so translation caches don't reuse old code
+const uint32_t jitCodegenVersion = 2;
+
+// Index of each 16-bit register in DCPURegisterInfo, in words. A through J
+// use their DCPUValue::Register numbers.
+enum GuestSlot {
+	SLOT_PC = 8,
+	SLOT_SP = 9,
+	SLOT_EX = 10,
+	SLOT_IA = 11,
+	NUM_SLOTS
+};
+
+// Callee-saved host registers that guest registers are kept in while a block
+// runs. The dispatcher saves them once, so blocks don't have to.
+static const uint8_t hostRegisterPool[] = {
+	REG_INDEX_RBX, REG_INDEX_R12, REG_INDEX_R13, REG_INDEX_R14, REG_INDEX_R15
+};
+#define HOST_REGISTER_POOL_SIZE (sizeof(hostRegisterPool)/sizeof(hostRegisterPool[0]))
+
+// Codegen-local types hold asmjit labels, which are hidden outside the
+// library, so they get internal linkage as well
+namespace {
+
+// The path a failed test takes when it's laid out after the block: charge
+// for the skip, and go back to the end of the body
+struct JITColdSkip {
+	Label entry;
+	Label end;
+	int32_t cost;
+	// The test, and the number of instructions it skips, for the profile
+	uint16_t pc;
+	uint32_t skipped;
+};
+
 // Stores state that is global throughout the codegen. Deleted
 // when codegen is finished.
 struct CodeGenState {
@@ -18,290 +73,421 @@ struct CodeGenState {
 	// set to -1
 	int8_t bindCtr;
 	Label condEndLbl;
+
+	// Offsets of the patchable jumps emitted by emitChainExit
+	std::vector<sysint_t> chainSites;
+
+	// Host register index holding each guest register for the whole
+	// block, or -1 if it's accessed in DCPURegisterInfo. PC and IA are
+	// never allocated.
+	int8_t hostReg[NUM_SLOTS];
+
+	// Guest registers the block may write anywhere. Allocated ones are
+	// stored back on every exit.
+	bool written[NUM_SLOTS];
+
+	// How guest cycles are charged, and for blocks charged on entry, the
+	// cost of the instructions after the one being emitted. Exits before
+	// the end of the block give that back.
+	JITCycleMode cycleMode;
+	uint32_t refund;
+
+	// Set while emitting an instruction whose EX result is never read
+	bool exDead;
+
+	// Whether guest memory is mapped twice, so register plus offset
+	// addresses don't have to be wrapped to 16 bits
+	bool memoryMirrored;
+
+	// The displacement to patch and the guest address of each indirect
+	// jump's cache, and the offsets the caches were placed at. Hits and
+	// misses are counted in profile mode.
+	std::vector<std::pair<sysint_t, uint16_t> > branchCacheRefs;
+	std::vector<sysint_t> branchCacheOffsets;
+	bool profile;
+
+	// Set while emitting the jump that closes an idle loop, to the cycles
+	// each time round the loop costs
+	uint32_t idleCost;
+
+	// Set while emitting the jump that closes a copy or fill loop, to its
+	// JITLoopIdiom
+	uint64_t loopIdiom;
+
+	// Blocks that will be recompiled once they're hot count the outcomes
+	// of their tests. The recompiled ones have the counts in
+	// traceProfile, and move skips that rarely happen out of line, to be
+	// emitted after the rest of the block.
+	bool countTests;
+	const JITTraceProfile* traceProfile;
+	std::vector<JITColdSkip> coldSkips;
 };
 
-/* Emission stuff. Mappings:
- * RDI (first parameter) is the DCPURegisterInfo pointer
- * RSI is swap space for any called routines (always clobbered)
- * EDX is swap space for any called routines (always clobbered)
- *
+}
+
+/* Emission stuff. The ABI of generated code:
+ * RDI (first parameter) is the DCPURegisterInfo pointer. It's saved around
+ *     every helper call, and is the same when a block returns.
+ * RBP is the base of the guest memory, loaded once by the dispatcher. Every
+ *     memory operand is word_ptr(rbp, r8, 1). Blocks never write it, and the
+ *     helpers they call preserve it, being callee-saved.
+ * RBX and R12-R15 hold the guest registers allocated for the block. The
+ *     dispatcher saves them, so blocks and their exits don't have to.
+ * R8 is the word address of the memory operand being accessed. It can run
+ *     past 0xffff where the guest memory is mirrored, and only the low 16
+ *     bits are meaningful.
+ * RAX, RCX, RDX, RSI, R9-R11 are scratch. Helper calls clobber them, along
+ *     with R8.
+ * Blocks are entered with the stack aligned as if just called, and return
+ *     0 or the address of a chainable jump in RAX.
  */
 
-// Read the passed register from the DCPURegisterInfo in rdi and
-// put it into eax
-void dcpuEmitRegisterRead(AsmJit::Assembler& s, DCPUValue::Register r) {
-	// Read from DCPU register into eax
-	s.movzx(eax, word_ptr(rdi, 2*((uint8_t)(r))));
+// Load a 16-bit value into reg, extending it as requested
+template<typename T>
+void emitExtendedLoad(Assembler& s, T& reg, const Mem& src, bool zx, bool sx) {
+	if(zx) {
+		s.movzx(reg, src);
+	} else if(sx) {
+		s.movsx(reg, src);
+	} else {
+		s.mov(reg, src);
+	}
 }
 
-// Write the passed register from eax into DCPURegisterInfo offset
-void dcpuEmitRegisterWrite(AsmJit::Assembler& s, DCPUValue::Register r) {
-	s.mov(word_ptr(rdi, 2*((uint8_t)(r))), eax);
+// Read a guest register into reg, from its host register if it has one
+template<typename T>
+void emitSlotLoad(Assembler& s, CodeGenState& cgs, int slot, T& reg, bool zx=true, bool sx=false) {
+	if(cgs.hostReg[slot] < 0) {
+		emitExtendedLoad(s, reg, word_ptr(rdi, 2*slot), zx, sx);
+		return;
+	}
+	GPReg src = gpw(cgs.hostReg[slot]);
+	if(reg.getSize() == 2) {
+		s.mov(reg, src);
+	} else if(sx) {
+		s.movsx(reg, src);
+	} else {
+		s.movzx(reg, src);
+	}
 }
 
-void dcpuEmitSpecialRead(AsmJit::Assembler& s, DCPUValue::ValueType r) {
-	uint8_t offs = 0;
-	switch(r) {
-		case DCPUValue::VT_SP:
-			offs = 9;
-			break;
-		case DCPUValue::VT_PC:
-			offs = 8;
-			break;
-		case DCPUValue::VT_EX:
-			offs = 10;
-			break;
-		default:	// Never happens - just here to silence warning
-			break;
+// Write the low 16 bits of reg to a guest register
+void emitSlotStore(Assembler& s, CodeGenState& cgs, int slot, const GPReg& reg) {
+	GPReg src = gpw(reg.getRegIndex());
+	if(cgs.hostReg[slot] < 0) {
+		s.mov(word_ptr(rdi, 2*slot), src);
+	} else {
+		s.movzx(gpd(cgs.hostReg[slot]), src);
 	}
-	s.movzx(eax, word_ptr(rdi, 2*offs));
 }
 
-void dcpuEmitSpecialWrite(AsmJit::Assembler& s, DCPUValue::ValueType r) {
-	uint8_t offs = 0;
-	switch(r) {
-		case DCPUValue::VT_SP:
-			offs = 9;
-			break;
-		case DCPUValue::VT_PC:
-			offs = 8;
-			break;
-		case DCPUValue::VT_EX:
-			offs = 10;
-			break;
-		default:
-			break;
+void emitSlotStore(Assembler& s, CodeGenState& cgs, int slot, uint16_t value) {
+	if(cgs.hostReg[slot] < 0) {
+		s.mov(word_ptr(rdi, 2*slot), value);
+	} else {
+		s.mov(gpd(cgs.hostReg[slot]), value);
 	}
-	s.mov(word_ptr(rdi, 2*offs), eax);
 }
 
-// Take the word address in eax and set eax or ebx to the memory value
-// at that address
-void dcpuEmitMemoryRead(AsmJit::Assembler& s, bool toEBX=false) {
-	// Fetch the base address for the CPU memory
-	s.mov(rdx, word_ptr(rdi, 12));
-	
-	// Write the value in eax into the CPU memory
-	s.movzx(eax, word_ptr(rdx, rax));
+// Store the allocated guest registers the block writes back to
+// DCPURegisterInfo. Emitted before every exit from the block, and before
+// calls to helpers that read the registers.
+void emitSpill(Assembler& s, CodeGenState& cgs) {
+	for(int i=0;i < NUM_SLOTS;i++) {
+		if(cgs.hostReg[i] >= 0 && cgs.written[i])
+			s.mov(word_ptr(rdi, 2*i), gpw(cgs.hostReg[i]));
+	}
 }
 
-// Take the word address in eax and write the value in ebx to it
-void dcpuEmitMemoryWrite(AsmJit::Assembler& s) {
-	// Emit 'movq 24(%rdi), %rdx'
-	s.mov(rdx, word_ptr(rdi, 12));
-	
-	// Emit 'movl %bx, (%rdx,%rbx,2)
-	s.mov(word_ptr(rdx, rbx), bx);
+// Load the allocated guest registers in [first, last] from DCPURegisterInfo
+void emitReload(Assembler& s, CodeGenState& cgs, int first=0, int last=NUM_SLOTS-1) {
+	for(int i=first;i <= last;i++) {
+		if(cgs.hostReg[i] >= 0)
+			s.movzx(gpd(cgs.hostReg[i]), word_ptr(rdi, 2*i));
+	}
+}
+
+// Give back the cycles charged on block entry for the instructions an exit
+// skips over
+void emitRefund(Assembler& s, CodeGenState& cgs) {
+	if(cgs.refund != 0)
+		s.add(qword_ptr(rdi, 0x18), cgs.refund);
 }
 
-// Takes the x86 carry flag and sets EX to its value
-void dcpuEmitCarry(AsmJit::Assembler& s, uint16_t value) {
-	s.push(eax);
-	s.push(ebx);
-	s.mov(eax, value);
-	s.mov(ebx, value);
-	s.cmovc(ebx, eax);
-	s.mov(word_ptr(rdi, 20), ebx);
-	s.pop(ebx);
-	s.pop(eax);
+// Store the overflow of an arithmetic instruction to EX, unless it's dead
+template<typename T>
+void emitOverflowStore(Assembler& s, CodeGenState& cgs, const T& reg) {
+	if(!cgs.exDead)
+		emitSlotStore(s, cgs, SLOT_EX, reg);
 }
 
 // Cycle hook - use this to check the interrupt status. If an interrupt is
-// fired, this should return a nonzero value.
+// fired, this should return a nonzero value. Only called when
+// info->interruptsPending is nonzero.
 uint8_t cycleHook(DCPURegisterInfo* info) {
-	if(info->ia == 0) return 0;
 	DCPUState* state = (DCPUState*)(info->statePtr);
+	return state->pollInterrupts() ? 1 : 0;
+}
 
-	// Update hardware information
-	// Check the interrupt queue
-	state->m_interruptMutex.lock();
-	if(state->interruptQueue.empty()) {
-		state->m_interruptMutex.unlock();
-		return 0;
+void emitHeader(AsmJit::Assembler& s) {
+	// No header - the caller does this for us now
+}
+
+void emitDCPUSetPC(Assembler& s, uint16_t n) {
+	// 16-bit values are 2 bytes each, offset 8 from the start of the struct
+	s.mov(word_ptr(rdi, 2*8), n);
+}
+
+// Load an entry of the JIT table into reg
+void emitTableLoad(Assembler& s, const GPReg& reg, JITTableEntry entry) {
+	s.mov(reg, qword_ptr(rdi, 0x40));
+	s.mov(reg, qword_ptr(reg, sizeof(void*)*entry));
+}
+
+// Add one to the 32-bit counter at offset in one of the tables of counters.
+// Clobbers rax.
+void emitCount(Assembler& s, JITTableEntry table, sysint_t offset) {
+	emitTableLoad(s, rax, table);
+	s.add(dword_ptr(rax, offset), 1);
+}
+
+// Add to the profile counts of the instruction at pc. Clobbers rax.
+void emitTracepoint(Assembler& s, uint16_t pc, uint32_t executions, uint32_t cycles) {
+	sysint_t entry = sizeof(DCPUInsnCounts)*pc;
+	emitTableLoad(s, rax, JIT_TABLE_INSN_COUNTS);
+	if(executions != 0)
+		s.add(qword_ptr(rax, entry + offsetof(DCPUInsnCounts, executions)), executions);
+	if(cycles != 0)
+		s.add(qword_ptr(rax, entry + offsetof(DCPUInsnCounts, cycles)), cycles);
+}
+
+// Call a helper through the JIT table. r10 is clobbered on top of what the
+// helper clobbers.
+void emitHelperCall(Assembler& s, JITTableEntry entry) {
+	s.mov(r10, qword_ptr(rdi, 0x40));
+	s.call(qword_ptr(r10, sizeof(void*)*entry));
+}
+
+// Return to cycle() without a chaining request
+void emitFooter(AsmJit::Assembler& s) {
+	s.mov(eax, 0);
+	s.ret();
+}
+
+// Store the allocated registers back and return to cycle()
+void emitBlockExit(Assembler& s, CodeGenState& cgs) {
+	emitRefund(s, cgs);
+	emitSpill(s, cgs);
+	emitFooter(s);
+}
+
+// Leave the block through a jump that cycle() can later patch to go straight
+// into the block at the new PC. Only used when the instruction just emitted
+// wrote a static target to PC.
+void emitChainJump(Assembler& s, CodeGenState& cgs);
+
+void emitChainExit(Assembler& s, CodeGenState& cgs) {
+	// The target block reloads the registers it uses, so they're stored
+	// back whichever way this exit goes
+	emitRefund(s, cgs);
+	emitSpill(s, cgs);
+
+	// An idle loop would go round until the budget ran out, unless an
+	// interrupt came in first. When none is waiting, skip to the end of
+	// the last time round: with K cycles left and C per time round, that
+	// leaves (K mod C) - C. The budget check below then stops the loop.
+	if(cgs.idleCost != 0) {
+		Label busy = s.newLabel();
+		s.cmp(dword_ptr(rdi, 0x2c), 0);
+		s.jne(busy);
+		s.mov(rax, qword_ptr(rdi, 0x18));
+		s.test(rax, rax);
+		s.js(busy);
+		s.xor_(edx, edx);
+		s.mov(ecx, cgs.idleCost);
+		s.div(rcx);
+		s.sub(rdx, rcx);
+		s.mov(qword_ptr(rdi, 0x18), rdx);
+		s.mov(byte_ptr(rdi, 0x2b), 1);
+		s.bind(busy);
 	}
-	// Mark the ISR flag, meaning that when the generated code
-	// returns after we do, the cycle function will catch this
-	// and handle the next interrupt.
-	state->isr = true;
-	state->m_interruptMutex.unlock();
-	return 1;
+
+	// Copy and fill loops run every time round but the last at once,
+	// as far as the budget goes
+	if(cgs.loopIdiom != 0) {
+		s.push(rdi);
+		s.mov(rsi, imm((sysint_t)cgs.loopIdiom));
+		emitHelperCall(s, JIT_TABLE_LOOP_IDIOM);
+		s.pop(rdi);
+	}
+
+	emitChainJump(s, cgs);
 }
 
-void emitCycleHook(AsmJit::Assembler& s, uint8_t cycles) {
+// The part of a chain exit after the registers are stored back. The budget is
+// still checked on every chained jump.
+void emitChainJump(Assembler& s, CodeGenState& cgs) {
+	Label stub = s.newLabel();
+	s.cmp(qword_ptr(rdi, 0x18), 0);
+	s.jl(stub);
+
+	// jmp rel32, which initially just lands on the stub right after it.
+	// Emitted by hand so the encoding is known when patching.
+	cgs.chainSites.push_back(s.getOffset());
+	s.db(0xe9);
+	s.dd(0);
+
+	// Return the address of the jump so it can be patched. This is
+	// lea rax, [rip-12], as the jump starts 5 bytes before this 7-byte
+	// instruction.
+	s.bind(stub);
+	s.db(0x48);
+	s.db(0x8d);
+	s.db(0x05);
+	s.dd((uint32_t)-12);
+	s.ret();
+}
+
+// Poll for interrupts before the instruction at pc is executed or charged for.
+// If one is taken, the block is left with PC pointing at that instruction.
+void emitCycleHook(AsmJit::Assembler& s, CodeGenState& cgs, uint16_t pc) {
 #ifdef DISABLE_CYCLE_HOOK
 	s.nop();
 #else
-	// Check the interrupt disable flag
+	// Only a single load is needed when nothing is queued
 	Label okay = s.newLabel();
-	s.movzx(eax, byte_ptr(rdi, 0x16));
-	s.cmp(eax, 0);
+	s.cmp(dword_ptr(rdi, 0x2c), 0);
 	s.je(okay);
 
 	// Emit a call to the cycle hook function
 	s.push(rdi);
-	s.call((void*)&cycleHook);
+	emitHelperCall(s, JIT_TABLE_CYCLE_HOOK);
 	s.pop(rdi);
 	
 	// Check for results
-	s.cmp(rax, 0);
+	s.test(al, al);
 	s.je(okay);
 	
 	// Here, the cycle hook returned a nonzero value
 	// so we should just return
-	s.ret();
+	emitDCPUSetPC(s, pc);
+	emitBlockExit(s, cgs);
 	
 	// Ignore
 	s.bind(okay);
 #endif
 }
 
-void emitHeader(AsmJit::Assembler& s) {
-	// No header - the caller does this for us now
-}
-
-void emitFooter(AsmJit::Assembler& s) {
-	s.mov(eax, 0);
-	s.ret();
+// Called from the generated code when it stores to a page that translated
+// code was generated from
+void codeWriteHook(DCPURegisterInfo* info, uint16_t addr) {
+	DCPUState* state = (DCPUState*)(info->statePtr);
+	state->memoryWritten(addr);
 }
 
-// Fetch the value in the specified register into eax. Note that you really really should zero-extend
-// this, as the value will run over from the next register if you don't. If you want sign-extension, that
-// works too. Just note that if you don't zero-extend or sign-extend, the assembler will treat the register
-// in the state structure as a 32-bit value, so you'll get two registers mashed together.
-template<typename T>
-void emitDCPUFetch(Assembler& s, DCPUValue r, T& reg, bool zx=true, bool sx=false) {
+// Compute the word address of a memory operand into r8, so the operand is
+// word_ptr(rbp, r8, 1). PUSH and POP also update the stack pointer here.
+void emitDCPUAddress(Assembler& s, CodeGenState& cgs, DCPUValue r) {
 	switch(r.val) {
-		case DCPUValue::VT_REGISTER:
-			if(zx) {
-				s.movzx(reg, word_ptr(rdi, 2*((uint8_t)(r.reg))));
-			} else if(sx) {
-				s.movsx(reg, word_ptr(rdi, 2*((uint8_t)(r.reg))));
-			} else {
-				s.mov(reg, word_ptr(rdi, 2*((uint8_t)(r.reg))));
-			}
-			break;
 		case DCPUValue::VT_INDIRECT_REGISTER:
-			s.mov(rsi, qword_ptr(rdi, 32));
-			s.movzx(rdx, word_ptr(rdi, 2*((uint8_t)(r.reg))));
-			if(zx) {
-				s.movzx(reg, word_ptr(rsi, rdx));
-			} else if(sx) {
-				s.movsx(reg, word_ptr(rsi, rdx));
-			} else {
-				s.mov(reg, word_ptr(rsi, rdx));
-			}
+			emitSlotLoad(s, cgs, r.reg, r8d);
 			break;
 		case DCPUValue::VT_INDIRECT_REGISTER_OFFSET:
-			s.mov(rsi, qword_ptr(rdi, 32));
-			s.movzx(rdx, word_ptr(rdi, 2*((uint8_t)(r.reg))));
-			s.add(rdx, r.nextWord);
-			// We have to multiply by two so we get the byte address
-			// instead of the word address
-			s.shl(rdx, 1);
-			if(zx) {
-				s.movzx(reg, word_ptr(rsi, rdx));
-			} else if(sx) {
-				s.movsx(reg, word_ptr(rsi, rdx));
-			} else {
-				s.mov(reg, word_ptr(rsi, rdx));
-			}
+			emitSlotLoad(s, cgs, r.reg, r8d);
+			s.add(r8d, r.nextWord);
+			if(!cgs.memoryMirrored)
+				s.movzx(r8d, r8w);
 			break;
 		case DCPUValue::VT_PUSHPOP:
-			s.mov(rdx, 0xffff);
+			emitSlotLoad(s, cgs, SLOT_SP, r8d);
 			if(r.b) { // Push - [--SP]
-				// Update and store the stack pointer
-				s.movzx(rcx, word_ptr(rdi, 0x12));
-				s.dec(rcx);
-				s.mov(word_ptr(rdi, 0x12), cx);
-				s.and_(rcx, rdx);
-				
-				// Convert to a byte address
-				s.shl(rcx, 1);
-
-				// Now read the memory - for science
-				s.mov(rsi, qword_ptr(rdi, 0x20));
-				if(zx) {
-					s.movzx(reg, word_ptr(rsi, rcx));
-				} else if(sx) {
-					s.movsx(reg, word_ptr(rsi, rcx));
-				} else {
-					s.mov(reg, word_ptr(rsi, rcx));
-				}
+				s.dec(r8w);
+				emitSlotStore(s, cgs, SLOT_SP, r8);
 			} else { // Pop - [SP++]
-				// Figure out the word address
-				s.movzx(rcx, word_ptr(rdi, 0x12));
-				
-				// Convert to byte address
-				s.shl(rcx, 1);
-				
-				// Read memory
-				s.mov(rsi, qword_ptr(rdi, 0x20));
-				if(zx) {
-					s.movzx(reg, word_ptr(rsi, rcx));
-				} else if(sx) {
-					s.movsx(reg, word_ptr(rsi, rcx));
-				} else {
-					s.mov(reg, word_ptr(rsi, rcx));
-				}
-				
-				// Update SP
-				s.shr(rcx, 1);
-				s.inc(rcx);
-				s.mov(word_ptr(rdi, 0x12), cx);
+				s.mov(r9d, r8d);
+				s.inc(r9d);
+				emitSlotStore(s, cgs, SLOT_SP, r9);
 			}
 			break;
 		case DCPUValue::VT_PEEK:
-			s.mov(rdx, 0xffff);
-			s.movzx(rcx, word_ptr(rdi, 0x12));
-			s.shl(rcx, 1);
-			s.mov(rsi, qword_ptr(rdi, 32));
-			if(zx) {
-				s.movzx(reg, word_ptr(rsi, rcx));
-			} else if(sx) {
-				s.movsx(reg, word_ptr(rsi, rcx));
-			} else {
-				s.mov(reg, word_ptr(rsi, rcx));
-			}
+			emitSlotLoad(s, cgs, SLOT_SP, r8d);
+			break;
+		case DCPUValue::VT_PICK:
+			emitSlotLoad(s, cgs, SLOT_SP, r8d);
+			s.add(r8w, r.nextWord);
 			break;
+		case DCPUValue::VT_MEMORY:
+			s.mov(r8d, r.nextWord);
+			break;
+		default:
+			break;
+	}
+}
+
+// Check whether the word stored to at r8 lies on a page translated code was
+// generated from, and let the JIT invalidate it if so. Only rsi and r8-r10 are
+// clobbered.
+void emitCodeWriteCheck(Assembler& s) {
+	Label clean = s.newLabel();
+	s.movzx(r9d, r8w);
+	s.shr(r9d, DCPU_CODE_PAGE_SHIFT);
+	s.mov(r10, qword_ptr(rdi, 0x38));
+	s.cmp(byte_ptr(r10, r9), 0);
+	s.je(clean);
+
+	// Five pushes keep the stack 16-byte aligned for the call
+	s.push(rax);
+	s.push(rcx);
+	s.push(rdx);
+	s.push(rdi);
+	s.push(r11);
+	s.movzx(esi, r8w);
+	emitHelperCall(s, JIT_TABLE_CODE_WRITE_HOOK);
+	s.pop(r11);
+	s.pop(rdi);
+	s.pop(rdx);
+	s.pop(rcx);
+	s.pop(rax);
+	s.bind(clean);
+}
+
+bool isMemoryValue(DCPUValue r) {
+	switch(r.val) {
+		case DCPUValue::VT_INDIRECT_REGISTER:
+		case DCPUValue::VT_INDIRECT_REGISTER_OFFSET:
+		case DCPUValue::VT_PUSHPOP:
+		case DCPUValue::VT_PEEK:
 		case DCPUValue::VT_PICK:
-			// TODO: Implement
+		case DCPUValue::VT_MEMORY:
+			return true;
+		default:
+			return false;
+	}
+}
+
+// Fetch the value in the specified register into eax. Note that you really really should zero-extend
+// this, as the value will run over from the next register if you don't. If you want sign-extension, that
+// works too. Just note that if you don't zero-extend or sign-extend, the assembler will treat the register
+// in the state structure as a 32-bit value, so you'll get two registers mashed together.
+template<typename T>
+void emitDCPUFetch(Assembler& s, CodeGenState& cgs, DCPUValue r, T& reg, bool zx=true, bool sx=false) {
+	if(isMemoryValue(r)) {
+		emitDCPUAddress(s, cgs, r);
+		emitExtendedLoad(s, reg, word_ptr(rbp, r8, 1), zx, sx);
+		return;
+	}
+	switch(r.val) {
+		case DCPUValue::VT_REGISTER:
+			emitSlotLoad(s, cgs, r.reg, reg, zx, sx);
 			break;
 		case DCPUValue::VT_SP:
-			if(zx) {
-				s.movzx(reg, word_ptr(rdi, 2*9));
-			} else if(sx) {
-				s.movsx(reg, word_ptr(rdi, 2*9));
-			} else {
-				s.mov(reg, word_ptr(rdi, 2*9));
-			}
+			emitSlotLoad(s, cgs, SLOT_SP, reg, zx, sx);
 			break;
 		case DCPUValue::VT_PC:
-			if(zx) {
-				s.movzx(reg, word_ptr(rdi, 2*8));
-			} else if(sx) {
-				s.movsx(reg, word_ptr(rdi, 2*8));
-			} else {
-				s.mov(reg, word_ptr(rdi, 2*8));
-			}
+			emitSlotLoad(s, cgs, SLOT_PC, reg, zx, sx);
 			break;
 		case DCPUValue::VT_EX:
-			if(zx) {
-				s.movzx(reg, word_ptr(rdi, 2*10));
-			} else if(sx) {
-				s.movsx(reg, word_ptr(rdi, 2*10));
-			} else {
-				s.mov(reg, word_ptr(rdi, 2*10));
-			}
-			break;
-		case DCPUValue::VT_MEMORY:
-			s.mov(rsi, qword_ptr(rdi, 32));
-			if(zx) {
-				s.movzx(reg, word_ptr(rsi, 2*r.nextWord));
-			} else if(sx) {
-				s.movsx(reg, word_ptr(rdi, 2*r.nextWord));
-			} else {
-				s.mov(reg, word_ptr(rsi, 2*r.nextWord));
-			}
+			emitSlotLoad(s, cgs, SLOT_EX, reg, zx, sx);
 			break;
 		case DCPUValue::VT_LITERAL:
 			if(sx) {
@@ -311,104 +497,72 @@ void emitDCPUFetch(Assembler& s, DCPUValue r, T& reg, bool zx=true, bool sx=fals
 				s.mov(reg, r.nextWord);
 			}
 			break;
+		default:
+			break;
 	}
 }
 
-Mem getRegisterMemory(DCPUValue r) {
-	return word_ptr(rdi, 2*((uint8_t)(r.reg)));
+// The 16-bit form of a register or literal operand
+inline GPReg wordView(const GPReg& reg) {
+	return gpw(reg.getRegIndex());
 }
 
-void emitDCPUSetPC(Assembler& s, uint16_t n) {
-	// 16-bit values are 2 bytes each, offset 8 from the start of the struct
-	s.mov(word_ptr(rdi, 2*8), n);
+inline uint16_t wordView(uint16_t value) {
+	return value;
 }
 
+// Store a register or a literal into the given value. Stores to guest memory
+// are checked against the code page map so self-modifying code is caught.
 template<typename T>
-void emitDCPUPut(Assembler& s, DCPUValue r, T &reg) {
+void emitDCPUPut(Assembler& s, CodeGenState& cgs, DCPUValue r, const T& reg) {
+	if(isMemoryValue(r)) {
+		emitDCPUAddress(s, cgs, r);
+		s.mov(word_ptr(rbp, r8, 1), wordView(reg));
+		emitCodeWriteCheck(s);
+		return;
+	}
 	switch(r.val) {
 		case DCPUValue::VT_REGISTER:
-			s.mov(word_ptr(rdi, 2*((uint8_t)(r.reg))), reg);
-			break;
-		case DCPUValue::VT_INDIRECT_REGISTER:
-			s.mov(rsi, qword_ptr(rdi, 32));
-			s.movzx(rdx, word_ptr(rdi, 2*((uint8_t)(r.reg))));
-			s.mov(word_ptr(rsi, rdx), reg);
-			break;
-		case DCPUValue::VT_INDIRECT_REGISTER_OFFSET:
-			s.mov(rsi, qword_ptr(rdi, 32));
-			s.movzx(rdx, word_ptr(rdi, 2*((uint8_t)(r.reg))));
-			s.add(rdx, r.nextWord);
-			// We have to multiply by two so we get the byte address
-			// instead of the word address
-			s.shl(rdx, 1);
-			s.mov(word_ptr(rsi, rdx), reg);
-			break;
-		case DCPUValue::VT_PUSHPOP:
-			s.mov(rdx, 0xffff);
-			if(r.b) { // Push - [--SP]
-				// Update and store the stack pointer
-				s.movzx(rcx, word_ptr(rdi, 0x12));
-				s.dec(rcx);
-				s.mov(word_ptr(rdi, 0x12), cx);
-				s.and_(rcx, rdx);
-				
-				// Convert to a byte address
-				s.shl(rcx, 1);
-
-				// Now write
-				s.mov(rsi, qword_ptr(rdi, 0x20));
-				s.mov(word_ptr(rsi, rcx), reg);
-			} else { // Pop - [SP++]
-				// Figure out the word address
-				s.movzx(rcx, word_ptr(rdi, 0x12));
-				
-				// Convert to byte address
-				s.shl(rcx, 1);
-				
-				// Write memory
-				s.mov(rsi, qword_ptr(rdi, 0x20));
-				s.mov(word_ptr(rdi, rcx), reg);
-				
-				// Update SP
-				s.shr(rcx, 1);
-				s.inc(rcx);
-				s.mov(word_ptr(rdi, 0x12), cx);
-			}
-			break;
-		case DCPUValue::VT_PEEK:
-			s.mov(rdx, 0xffff);
-			s.movzx(rcx, word_ptr(rdi, 0x12));
-			s.shl(rcx, 1);
-			s.mov(rsi, qword_ptr(rdi, 32));
-			s.mov(word_ptr(rsi, rcx), reg);
-			break;
-		case DCPUValue::VT_PICK:
+			emitSlotStore(s, cgs, r.reg, reg);
 			break;
 		case DCPUValue::VT_SP:
-			s.mov(word_ptr(rdi, 2*9), reg);
+			emitSlotStore(s, cgs, SLOT_SP, reg);
 			break;
 		case DCPUValue::VT_PC:
-			s.mov(word_ptr(rdi, 2*8), reg);
+			emitSlotStore(s, cgs, SLOT_PC, reg);
 			break;
 		case DCPUValue::VT_EX:
-			s.mov(word_ptr(rdi, 2*10), reg);
-			break;
-		case DCPUValue::VT_MEMORY:
-			s.mov(rsi, qword_ptr(rdi, 32));
-			s.mov(word_ptr(rsi, r.nextWord*2), reg);
+			emitSlotStore(s, cgs, SLOT_EX, reg);
 			break;
-		case DCPUValue::VT_LITERAL:
-			// Fail silently
+		default:
+			// Writes to literals fail silently
 			break;
 	}
 }
 
+// Leave the block if a store made by the instruction just emitted dropped a
+// translation, as it may have been this one. Execution resumes at nextPC.
+void emitCodeInvalidationCheck(Assembler& s, CodeGenState& cgs, uint16_t nextPC) {
+	Label okay = s.newLabel();
+	s.cmp(byte_ptr(rdi, 0x2a), 0);
+	s.je(okay);
+	emitDCPUSetPC(s, nextPC);
+	emitBlockExit(s, cgs);
+	s.bind(okay);
+}
+
 template<typename T>
 void emitCostCycles(Assembler& s, T &num) {
 	s.sub(qword_ptr(rdi, 24), num);
 }
 
-// Proxy calls for the HWI, HWQ, and HWN instructions
+// Proxy calls for INT, and the HWI, HWQ, and HWN instructions
+
+void queueInterrupt(DCPURegisterInfo* info, uint16_t n) {
+	DCPUState* s = (DCPUState*)info->statePtr;
+	s->triggerInterrupt(n);
+}
+
 
 uint16_t hardwareNumberQuery(DCPURegisterInfo* regInfo) {
 	DCPUState* state = (DCPUState*)(regInfo->statePtr);
@@ -417,6 +571,7 @@ uint16_t hardwareNumberQuery(DCPURegisterInfo* regInfo) {
 
 void hardwareQuery(DCPURegisterInfo* regInfo, uint16_t n) {
 	DCPUState* state = (DCPUState*)(regInfo->statePtr);
+	if(n >= state->hardware.size()) return;
 	DCPUHardwareInformation info = state->hardware[n]->getInformation();
 	regInfo->a = info.hwID & 0x0000FFFF;
 	regInfo->b = (info.hwID & 0xFFFF0000) >> 16;
@@ -427,28 +582,580 @@ void hardwareQuery(DCPURegisterInfo* regInfo, uint16_t n) {
 
 uint16_t hardwareInterrupt(DCPURegisterInfo* regInfo, uint16_t n) {
 	DCPUState* state = (DCPUState*)(regInfo->statePtr);
+	if(n >= state->hardware.size()) return 0;
 	return state->hardware[n]->onInterrupt(state);
 }
 
-JITProcessor::JITProcessor() {
+// A loop that stores to successive words, made of one store, the register
+// steps, a test of the counter against a literal, and a jump back
+enum JITLoopKind {
+	JIT_LOOP_COPY,		// STI/STD [dst], [src]
+	JIT_LOOP_FILL,		// STI/STD [dst], literal, or SET [dst] and ADD/SUB
+	JIT_LOOP_FILL_REG	// The same, from a register
+};
+
+// Packed into the 64-bit immediate passed to loopIdiomHelper
+struct JITLoopIdiom {
+	uint16_t end;		// The counter's value when the loop is left
+	uint16_t value;		// Fill literal, or the source register
+	uint8_t cost;		// Cycles each time round
+	uint8_t kind;
+	uint8_t regs;		// Destination in the low nibble, counter in the high
+	int8_t step;		// +1 or -1
+	// STI and STD step I and J. SET loops step the destination with ADD or
+	// SUB, which store EX.
+	bool stepsIJ() const { return kind & 0x80; }
+	JITLoopKind loopKind() const { return (JITLoopKind)(kind & 0x7f); }
+};
+BOOST_STATIC_ASSERT(sizeof(JITLoopIdiom) == sizeof(uint64_t));
+
+// Called from the jump that closes a copy or fill loop, with the registers in
+// info. Does every remaining time round but the last, which leaves the loop,
+// the way the compiled code would have until the budget ran out. Stores to
+// pages translated code came from are left to the compiled code, which stops
+// when one drops a translation.
+void loopIdiomHelper(DCPURegisterInfo* info, uint64_t packed) {
+	JITLoopIdiom loop;
+	memcpy(&loop, &packed, sizeof(loop));
+	if(info->cycles < 0 || info->interruptsPending != 0) return;
+
+	uint16_t* regs = &info->a;
+	int dst = loop.regs & 0xf, counter = loop.regs >> 4;
+	uint16_t left = (uint16_t)(loop.end - regs[counter]);
+	if(loop.step < 0) left = -left;
+	// A counter that's already at the end is left to the compiled code
+	if(left == 0) return;
+	uint64_t times = std::min((uint64_t)left - 1, (uint64_t)(info->cycles / loop.cost) + 1);
+
+	// Count the stores up to the first code page, a page at a time
+	uint64_t clear = 0;
+	uint16_t addr = regs[dst];
+	const uint32_t pageWords = 1 << DCPU_CODE_PAGE_SHIFT;
+	while(clear < times && info->codePages[addr >> DCPU_CODE_PAGE_SHIFT] == 0) {
+		uint32_t inPage = (loop.step > 0) ? pageWords - (addr & (pageWords - 1)) :
+			(addr & (pageWords - 1)) + 1;
+		clear += inPage;
+		addr += loop.step * (int32_t)inPage;
+	}
+	times = std::min(times, clear);
+	if(times == 0) return;
+
+	// Word by word, the copy sees its own stores where the ranges overlap.
+	// memmove and fill_n do the same when the ranges don't wrap and are
+	// copied in an order where they can't see them.
+	uint16_t* mem = info->memory;
+	uint16_t d = regs[dst];
+	uint16_t first = (loop.step > 0) ? d : (uint16_t)(d - (times - 1));
+	bool wraps = (uint32_t)first + times > 0x10000;
+	if(loop.loopKind() == JIT_LOOP_COPY) {
+		uint16_t src = regs[loop.value];
+		uint16_t from = (loop.step > 0) ? src : (uint16_t)(src - (times - 1));
+		bool seesStores = (loop.step > 0) ? (d > src && (uint64_t)(d - src) < times) :
+			(src > d && (uint64_t)(src - d) < times);
+		if(!wraps && !seesStores && (uint32_t)from + times <= 0x10000) {
+			memmove(mem + first, mem + from, times*sizeof(uint16_t));
+		} else {
+			for(uint64_t n=0;n < times;n++,d += loop.step,src += loop.step)
+				mem[d] = mem[src];
+		}
+	} else {
+		uint16_t value = (loop.loopKind() == JIT_LOOP_FILL) ? loop.value : regs[loop.value];
+		if(!wraps) {
+			std::fill_n(mem + first, times, value);
+		} else {
+			for(uint64_t n=0;n < times;n++,d += loop.step)
+				mem[d] = value;
+		}
+	}
+
+	// Step the registers, and store the EX of the last ADD or SUB
+	uint16_t moved = (uint16_t)(loop.step * (int64_t)times);
+	if(loop.stepsIJ()) {
+		info->i += moved;
+		info->j += moved;
+	} else {
+		uint16_t last = regs[dst] + moved - loop.step;
+		regs[dst] += moved;
+		if(loop.step > 0)
+			info->ex = (last == 0xffff) ? 1 : 0;
+		else
+			info->ex = (last == 0) ? 0xffff : 0;
+	}
+	info->cycles -= times * loop.cost;
+}
+
+JITOptions::JITOptions() : cycleMode(JIT_CYCLES_PER_INSN),
+		tierThreshold(JIT_DEFAULT_TIER_THRESHOLD), profile(false),
+		codeCacheSize(JIT_DEFAULT_CODE_CACHE_SIZE), backgroundCompile(false),
+		hotThreshold(0) {
+}
+
+JITCodeArena::JITCodeArena(size_t capacity) : m_top(0), m_floor(0) {
+	sysuint_t allocated = 0;
+	m_base = (uint8_t*)VirtualMemory::alloc(capacity, &allocated, true);
+	m_capacity = (m_base == NULL) ? 0 : allocated;
+}
+
+JITCodeArena::~JITCodeArena() {
+	if(m_base != NULL)
+		VirtualMemory::free(m_base, m_capacity);
+}
+
+// Blocks start on 16-byte boundaries, like the allocator they replace put them
+#define JIT_CODE_ALIGNMENT 16
+
+uint32_t JITCodeArena::generate(void** dest, Assembler* assembler) {
+	size_t size = assembler->getCodeSize();
+	if(size == 0) {
+		*dest = NULL;
+		return ERROR_NO_FUNCTION;
+	}
+	if(!fits(size)) {
+		*dest = NULL;
+		return ERROR_NO_VIRTUAL_MEMORY;
+	}
+	uint8_t* p = allocate(size);
+	assembler->relocCode(p);
+	*dest = p;
+	return ERROR_NONE;
+}
+
+bool JITCodeArena::fits(size_t size) const {
+	return size <= m_capacity - m_top;
+}
+
+uint8_t* JITCodeArena::allocate(size_t size) {
+	if(!fits(size)) return NULL;
+	uint8_t* p = m_base + m_top;
+	m_top = (m_top + size + JIT_CODE_ALIGNMENT - 1) & ~(size_t)(JIT_CODE_ALIGNMENT - 1);
+	if(m_top > m_capacity) m_top = m_capacity;
+	return p;
+}
+
+void JITCodeArena::setFloor() {
+	m_floor = m_top;
+}
+
+void JITCodeArena::flush() {
+	m_top = m_floor;
+}
+
+// Build the stub indirect jumps go through when their cache misses. It's
+// jumped to with the new PC in eax and the cache to fill in r9, or 0 for
+// none. If there's code for the PC and budget left, the cache's newest target
+// is replaced and the code is jumped to, otherwise control goes back to
+// cycle().
+static void* makeLookupStub(dcpu64Func* codeCache, CodeGenerator* arena) {
+	Assembler s(arena);
+	Label exit = s.newLabel();
+	Label go = s.newLabel();
+	s.mov(rdx, imm((sysint_t)codeCache));
+	s.mov(rdx, qword_ptr(rdx, rax, 3));
+	s.test(rdx, rdx);
+	s.jz(exit);
+	s.cmp(qword_ptr(rdi, 0x18), 0);
+	s.jl(exit);
+	s.test(r9, r9);
+	s.jz(go);
+
+	// Move the older targets down a way to make room
+	for(int w=JIT_BRANCH_CACHE_WAYS-1;w > 0;w--) {
+		s.mov(ecx, dword_ptr(r9, offsetof(JITBranchCache, pc) + 4*(w-1)));
+		s.mov(dword_ptr(r9, offsetof(JITBranchCache, pc) + 4*w), ecx);
+		s.mov(r10, qword_ptr(r9, offsetof(JITBranchCache, code) + 8*(w-1)));
+		s.mov(qword_ptr(r9, offsetof(JITBranchCache, code) + 8*w), r10);
+	}
+	s.mov(dword_ptr(r9, offsetof(JITBranchCache, pc)), eax);
+	s.mov(qword_ptr(r9, offsetof(JITBranchCache, code)), rdx);
+	s.bind(go);
+	s.jmp(rdx);
+
+	s.bind(exit);
+	emitFooter(s);
+	return s.make();
+}
+
+// Build the dispatcher, which is called from cycle() with the block at PC
+// known to be compiled and the budget not yet spent. It saves the registers
+// the blocks clobber once and pins the guest memory base, as the generated
+// code's ABI asks. It then keeps looking up and calling the block at PC
+// until one isn't compiled, or cycle() has work to do: linking a chainable
+// exit, taking an interrupt that isn't queued, releasing invalidated blocks, recompiling a hot
+// one or stopping when the budget is spent or the processor has caught fire.
+static void* makeDispatcher(dcpu64Func* codeCache, volatile bool* ignited, CodeGenerator* arena) {
+	Assembler s(arena);
+	Label loop = s.newLabel();
+	Label miss = s.newLabel();
+	Label exit = s.newLabel();
+	Label noInterrupt = s.newLabel();
+
+	// Six pushes and the state pointer leave the stack aligned like the
+	// caller's for calls into the blocks. rbp is pinned to the guest memory
+	// for all of them.
+	s.push(rbx);
+	s.push(rbp);
+	s.push(r12);
+	s.push(r13);
+	s.push(r14);
+	s.push(r15);
+	s.push(rdi);
+	s.mov(rbp, qword_ptr(rdi, 0x20));
+
+	s.bind(loop);
+	s.movzx(eax, word_ptr(rdi, 0x10));
+	s.mov(rdx, imm((sysint_t)codeCache));
+	s.mov(rdx, qword_ptr(rdx, rax, 3));
+	s.test(rdx, rdx);
+	s.jz(miss);
+	s.call(rdx);
+	s.mov(rdi, qword_ptr(rsp));
+
+	s.test(rax, rax);
+	s.jnz(exit);
+	s.cmp(qword_ptr(rdi, 0x18), 0);
+	s.jl(exit);
+	// Pending interrupts stay queued while a handler runs, so they're only
+	// worth going back to cycle() for when they can be taken
+	s.cmp(dword_ptr(rdi, 0x2c), 0);
+	s.je(noInterrupt);
+	s.cmp(byte_ptr(rdi, 0x29), 0);
+	s.je(exit);
+	s.bind(noInterrupt);
+	s.cmp(byte_ptr(rdi, 0x2a), 0);
+	s.jne(exit);
+	s.cmp(byte_ptr(rdi, 0x48), 0);
+	s.jne(exit);
+	s.mov(rdx, imm((sysint_t)ignited));
+	s.cmp(byte_ptr(rdx), 0);
+	s.je(loop);
+	s.jmp(exit);
+
+	s.bind(miss);
+	s.xor_(eax, eax);
+	s.bind(exit);
+	s.add(rsp, 8);
+	s.pop(r15);
+	s.pop(r14);
+	s.pop(r13);
+	s.pop(r12);
+	s.pop(rbp);
+	s.pop(rbx);
+	s.ret();
+	return s.make();
+}
+
+// A block handed to the background compiler, with the guest words it was
+// decoded from. It's only installed if memory still holds them.
+struct JITCompileJob {
+	std::vector<DCPUInsn> insns;
+	std::vector<bool> followed;
+	std::vector<uint16_t> words;
+	JITCachedBlock compiled;
+	// Set for a hot block's second translation, which replaces its first
+	bool recompile;
+	JITTraceProfile profile;
+};
+
+JITProcessor::JITProcessor(const JITOptions& options) : m_options(options),
+		m_arena(std::max(options.codeCacheSize, (size_t)JIT_MIN_CODE_CACHE_SIZE)),
+		m_flushes(0), m_savedLoads(0), m_savedStores(0), m_compiler(NULL),
+		m_compilerStop(false), m_compilesInFlight(0), m_compilePending(0x10000, false) {
 	m_codeCache = (dcpu64Func*)malloc(sizeof(dcpu64Func)*0x10000);
 	memset(m_codeCache, 0, sizeof(dcpu64Func)*0x10000);
 	m_chunkCosts = (uint32_t*)malloc(sizeof(uint32_t)*0x10000);
 	memset(m_chunkCosts, 0, sizeof(uint32_t)*0x10000);
+	m_blockCounts = (uint32_t*)malloc(sizeof(uint32_t)*0x10000);
+	memset(m_blockCounts, 0, sizeof(uint32_t)*0x10000);
+	m_testCounts = (JITTestCounts*)malloc(sizeof(JITTestCounts)*0x10000);
+	memset(m_testCounts, 0, sizeof(JITTestCounts)*0x10000);
+	m_promotions = 0;
+	m_insnCounts = NULL;
+	if(m_options.profile) {
+		m_insnCounts = (DCPUInsnCounts*)malloc(sizeof(DCPUInsnCounts)*0x10000);
+		memset(m_insnCounts, 0, sizeof(DCPUInsnCounts)*0x10000);
+	}
+
+	m_returnStack.top = 0;
+	m_lookupStub = makeLookupStub(m_codeCache, &m_arena);
+	m_dispatcher = function_cast<JITDispatchFunc>(
+			makeDispatcher(m_codeCache, &m_state.ignited, &m_arena));
+	m_table[JIT_TABLE_RETURN_STACK] = (void*)&m_returnStack;
+	m_table[JIT_TABLE_CODE_CACHE] = (void*)m_codeCache;
+	m_table[JIT_TABLE_LOOKUP_STUB] = m_lookupStub;
+	m_table[JIT_TABLE_CYCLE_HOOK] = (void*)&cycleHook;
+	m_table[JIT_TABLE_CODE_WRITE_HOOK] = (void*)&codeWriteHook;
+	m_table[JIT_TABLE_HARDWARE_NUMBER] = (void*)&hardwareNumberQuery;
+	m_table[JIT_TABLE_HARDWARE_QUERY] = (void*)&hardwareQuery;
+	m_table[JIT_TABLE_HARDWARE_INTERRUPT] = (void*)&hardwareInterrupt;
+	m_table[JIT_TABLE_QUEUE_INTERRUPT] = (void*)&queueInterrupt;
+	m_table[JIT_TABLE_LOOP_IDIOM] = (void*)&loopIdiomHelper;
+	m_table[JIT_TABLE_BLOCK_COUNTS] = (void*)m_blockCounts;
+	m_table[JIT_TABLE_TEST_COUNTS] = (void*)m_testCounts;
+	m_table[JIT_TABLE_INSN_COUNTS] = (void*)m_insnCounts;
+	m_state.info.jitTable = m_table;
+	m_arena.setFloor();
+	clearPredictions();
+
+	m_state.codeWriteHandler = &JITProcessor::onCodeWrite;
+	m_state.codeWriteContext = (void*)this;
+
+	if(m_options.backgroundCompile && m_options.tierThreshold != 0)
+		m_compiler = new boost::thread(&JITProcessor::compilerMain, this);
 }
 
 JITProcessor::~JITProcessor() {
-	// Free the code cache
-	std::list<uint16_t>::iterator i;
-	for(i=m_cacheAddrs.begin();i != m_cacheAddrs.end();i++) {
-		if(m_codeCache[*i] != NULL)
-			MemoryManager::getGlobal()->free(
-					(void*)(m_codeCache[*i]));
+	if(m_compiler != NULL) {
+		{
+			boost::lock_guard<boost::mutex> lock(m_compileLock);
+			m_compilerStop = true;
+		}
+		m_compileWake.notify_one();
+		m_compiler->join();
+		delete m_compiler;
+		JITCompileJob* job;
+		while(m_compileRequests.pop(job)) delete job;
+		while(m_compileResults.pop(job)) delete job;
 	}
-	
-	// Free the cache arrays
+
+	// The code and the branch caches in it go with the arena. Free the
+	// cache arrays.
 	free(m_codeCache);
 	free(m_chunkCosts);
+	free(m_blockCounts);
+	free(m_testCounts);
+	free(m_insnCounts);
+}
+
+bool JITProcessor::onCodeWrite(void* ctx, uint16_t addr, uint32_t len) {
+	return ((JITProcessor*)ctx)->invalidateRange(addr, len);
+}
+
+// Returns true if the two ranges of guest memory share a word. Both ranges
+// may wrap around the end of memory.
+static bool rangesOverlap(uint16_t aStart, uint32_t aLen, uint16_t bStart, uint32_t bLen) {
+	return ((uint16_t)(bStart - aStart) < aLen) || ((uint16_t)(aStart - bStart) < bLen);
+}
+
+// Drop every block decoded from any word in [addr, addr+len)
+bool JITProcessor::invalidateRange(uint16_t addr, uint32_t len) {
+	bool hit = false;
+	uint32_t first = addr >> DCPU_CODE_PAGE_SHIFT;
+	uint32_t last = ((uint32_t)addr + len - 1) >> DCPU_CODE_PAGE_SHIFT;
+	if(last - first >= DCPU_CODE_PAGES) last = first + DCPU_CODE_PAGES - 1;
+	for(uint32_t p=first;p <= last;p++) {
+		// Copy the list, since invalidating a block modifies it
+		std::vector<uint16_t> blocks = m_pageBlocks[p % DCPU_CODE_PAGES];
+		std::vector<uint16_t>::iterator i;
+		for(i=blocks.begin();i != blocks.end();i++) {
+			std::map<uint16_t, JITBlockInfo>::iterator blk = m_blocks.find(*i);
+			if(blk == m_blocks.end()) continue;
+
+			std::vector<JITCodeRange>& ranges = blk->second.ranges;
+			for(size_t r=0;r < ranges.size();r++) {
+				if(rangesOverlap(ranges[r].start, ranges[r].length, addr, len)) {
+					invalidateBlock(*i);
+					hit = true;
+					break;
+				}
+			}
+		}
+	}
+	return hit;
+}
+
+void JITProcessor::invalidateBlock(uint16_t pc) {
+	std::map<uint16_t, JITBlockInfo>::iterator blk = m_blocks.find(pc);
+	if(blk == m_blocks.end()) return;
+
+	// The block may be the one that's currently running, so its code is
+	// left in the arena until the next flush
+	if(m_codeCache[pc] != NULL)
+		clearPredictions();
+	m_codeCache[pc] = NULL;
+
+	unlinkBlock(blk->second);
+	retireBranchCaches(blk->second);
+
+	// Unlink the block from the pages it covered
+	std::vector<JITCodeRange>& ranges = blk->second.ranges;
+	for(size_t r=0;r < ranges.size();r++) {
+		uint32_t first = ranges[r].start >> DCPU_CODE_PAGE_SHIFT;
+		uint32_t last = ((uint32_t)ranges[r].start + ranges[r].length - 1) >> DCPU_CODE_PAGE_SHIFT;
+		for(uint32_t p=first;p <= last;p++) {
+			std::vector<uint16_t>& pg = m_pageBlocks[p % DCPU_CODE_PAGES];
+			pg.erase(std::remove(pg.begin(), pg.end(), pc), pg.end());
+			if(pg.empty())
+				m_state.codePages[p % DCPU_CODE_PAGES] = 0;
+		}
+	}
+	m_blocks.erase(blk);
+}
+
+void JITProcessor::registerBlock(uint16_t pc, const JITBlockInfo& info) {
+	m_blocks[pc] = info;
+	for(size_t e=0;e < info.exits.size();e++)
+		m_exitOwners[info.exits[e]] = pc;
+	for(size_t r=0;r < info.ranges.size();r++) {
+		uint32_t first = info.ranges[r].start >> DCPU_CODE_PAGE_SHIFT;
+		uint32_t last = ((uint32_t)info.ranges[r].start + info.ranges[r].length - 1) >> DCPU_CODE_PAGE_SHIFT;
+		for(uint32_t p=first;p <= last;p++) {
+			std::vector<uint16_t>& pg = m_pageBlocks[p % DCPU_CODE_PAGES];
+			if(std::find(pg.begin(), pg.end(), pc) == pg.end())
+				pg.push_back(pc);
+			m_state.codePages[p % DCPU_CODE_PAGES] = 1;
+		}
+	}
+}
+
+// Patch the chainable exit at site to jump directly into the block at target,
+// compiling it first if needed
+void JITProcessor::linkBlock(uint8_t* site, uint16_t target) {
+	// The exit may belong to a block that was invalidated while it ran
+	std::map<uint8_t*, uint16_t>::iterator owner = m_exitOwners.find(site);
+	if(owner == m_exitOwners.end()) return;
+
+	// Patched exits still return here when the budget runs out
+	if(*(int32_t*)(site + 1) != 0) return;
+
+	if(m_codeCache[target] == NULL) {
+		// Blocks still being interpreted are linked once they're compiled
+		if(m_options.tierThreshold != 0) return;
+		uint32_t flushes = m_flushes;
+		m_state.info.pc = target;
+		generateCode();
+		// Making room for the new block may have flushed the exit
+		if(m_codeCache[target] == NULL || m_flushes != flushes) return;
+	}
+
+	// The exit is a 5-byte jmp rel32
+	int64_t rel = (uint8_t*)m_codeCache[target] - (site + 5);
+	if(rel != (int32_t)rel) return;
+	*(int32_t*)(site + 1) = (int32_t)rel;
+
+	JITLink link;
+	link.site = site;
+	link.from = owner->second;
+	link.to = target;
+	m_blocks[link.from].outgoing.push_back(link);
+	m_blocks[link.to].incoming.push_back(link);
+}
+
+static bool linkHasSite(const JITLink& link, uint8_t* site) {
+	return link.site == site;
+}
+
+// Undo every patched jump into or out of a block that's being invalidated
+void JITProcessor::unlinkBlock(JITBlockInfo& info) {
+	std::vector<JITLink>::iterator i;
+	for(i=info.outgoing.begin();i != info.outgoing.end();i++) {
+		if(m_blocks.count(i->to) == 0) continue;
+		std::vector<JITLink>& in = m_blocks[i->to].incoming;
+		std::vector<JITLink>::iterator j;
+		for(j=in.begin();j != in.end();) {
+			if(linkHasSite(*j, i->site)) j = in.erase(j);
+			else j++;
+		}
+	}
+	for(i=info.incoming.begin();i != info.incoming.end();i++) {
+		// Point the jump back at the stub that follows it
+		*(int32_t*)(i->site + 1) = 0;
+		if(m_blocks.count(i->from) == 0) continue;
+		std::vector<JITLink>& out = m_blocks[i->from].outgoing;
+		std::vector<JITLink>::iterator j;
+		for(j=out.begin();j != out.end();) {
+			if(linkHasSite(*j, i->site)) j = out.erase(j);
+			else j++;
+		}
+	}
+	std::vector<uint8_t*>::iterator e;
+	for(e=info.exits.begin();e != info.exits.end();e++)
+		m_exitOwners.erase(*e);
+	info.incoming.clear();
+	info.outgoing.clear();
+}
+
+void JITProcessor::flushCodeCache() {
+	std::map<uint16_t, JITBlockInfo>::iterator i;
+	for(i=m_blocks.begin();i != m_blocks.end();i++)
+		retireBranchCaches(i->second);
+	m_blocks.clear();
+	m_exitOwners.clear();
+	for(uint32_t p=0;p < DCPU_CODE_PAGES;p++) {
+		m_pageBlocks[p].clear();
+		m_state.codePages[p] = 0;
+	}
+	memset(m_codeCache, 0, sizeof(dcpu64Func)*0x10000);
+	clearPredictions();
+	m_arena.flush();
+	m_flushes++;
+}
+
+// Keep the counts of a dropped block's caches, which stay in the arena with
+// its code
+void JITProcessor::retireBranchCaches(JITBlockInfo& info) {
+	std::vector<JITBranchCache*>::iterator c;
+	for(c=info.branchCaches.begin();c != info.branchCaches.end();c++) {
+		std::pair<uint64_t, uint64_t>& counts = m_retiredBranchCounts[(*c)->site];
+		counts.first += (*c)->hits;
+		counts.second += (*c)->misses;
+	}
+	info.branchCaches.clear();
+}
+
+// Forget every predicted return and cached jump target, so none of them can
+// jump into retired code
+void JITProcessor::clearPredictions() {
+	for(uint32_t i=0;i < JIT_RETURN_STACK_SIZE;i++) {
+		m_returnStack.entries[i].pc = JIT_RETURN_NONE;
+		m_returnStack.entries[i].code = NULL;
+	}
+
+	std::map<uint16_t, JITBlockInfo>::iterator blk;
+	for(blk=m_blocks.begin();blk != m_blocks.end();blk++) {
+		std::vector<JITBranchCache*>& caches = blk->second.branchCaches;
+		for(size_t c=0;c < caches.size();c++) {
+			for(int w=0;w < JIT_BRANCH_CACHE_WAYS;w++) {
+				caches[c]->pc[w] = JIT_RETURN_NONE;
+				caches[c]->code[w] = NULL;
+			}
+		}
+	}
+}
+
+const DCPUInsnCounts* JITProcessor::insnCounts() const {
+	return m_insnCounts;
+}
+
+void JITProcessor::writeProfile(FILE* f) {
+	fprintf(f, "Code cache: %lu of %lu bytes used, %u flushes\n",
+			(unsigned long)m_arena.used(), (unsigned long)m_arena.capacity(),
+			m_flushes);
+	if(!m_options.translationCache.empty()) {
+		fprintf(f, "Translation cache: %u blocks loaded, %u saved\n",
+				m_savedLoads, m_savedStores);
+	}
+	if(m_options.hotThreshold != 0)
+		fprintf(f, "Hot blocks recompiled: %u\n", m_promotions);
+
+	std::map<uint16_t, std::pair<uint64_t, uint64_t> > counts = m_retiredBranchCounts;
+	std::map<uint16_t, JITBlockInfo>::iterator blk;
+	for(blk=m_blocks.begin();blk != m_blocks.end();blk++) {
+		std::vector<JITBranchCache*>& caches = blk->second.branchCaches;
+		for(size_t c=0;c < caches.size();c++) {
+			counts[caches[c]->site].first += caches[c]->hits;
+			counts[caches[c]->site].second += caches[c]->misses;
+		}
+	}
+
+	fprintf(f, "Indirect jump caches:\n");
+	std::map<uint16_t, std::pair<uint64_t, uint64_t> >::iterator i;
+	for(i=counts.begin();i != counts.end();i++) {
+		uint64_t total = i->second.first + i->second.second;
+		fprintf(f, "  %04x: %llu hits, %llu misses (%.1f%%)\n", i->first,
+				(unsigned long long)i->second.first,
+				(unsigned long long)i->second.second,
+				(total == 0) ? 0.0 : 100.0*i->second.first/total);
+	}
 }
 
 void JITProcessor::inject(uint64_t cycles) {
@@ -457,160 +1164,231 @@ void JITProcessor::inject(uint64_t cycles) {
 }
 
 bool JITProcessor::cycle() {
+	if(m_state.ignited) return false;
+
 	// Check the current instruction pointer to see if it's in the code
-	// cache
-	if(m_codeCache[m_state.info.pc] == NULL) {
+	// cache. If not, the block is interpreted until it's been run often
+	// enough to be worth compiling.
+	if(m_compilesInFlight != 0)
+		installCompiled();
+	uint16_t pc = m_state.info.pc;
+	JITBlockInfo* interpreted = NULL;
+	if(m_codeCache[pc] == NULL) {
+		if(m_options.tierThreshold != 0) {
+			interpreted = &interpretedBlock(pc);
+			// Blocks saved by an earlier run skip the interpreter
+			if(interpreted->executions == 0 && loadSavedBlock(pc, *interpreted)) {
+				interpreted = NULL;
+			} else if(++interpreted->executions >= m_options.tierThreshold) {
+				// With a background compiler, the block carries on
+				// being interpreted until its code is ready
+				if(m_compiler == NULL) {
+					invalidateBlock(pc);
+					interpreted = NULL;
+				} else if(!m_compilePending[pc]) {
+					requestCompile(pc);
+				}
+			}
+		}
 		// Generate new code for the instruction pointer
-		generateCode();
+		if(interpreted == NULL && m_codeCache[pc] == NULL)
+			generateCode();
 	}
 	
-	// Check for queued cycles. The volatile pointer is a derpy trick to force
-	// gcc to re-fetch the value of m_state.info.cycles from memory, after the
-	// assembled code borks around with it. If it's not declared volatile or if
-	// a pointer isn't used, it'll cache the result in a register and m_state.elapsed
-	// will be 0 all the time.
-	volatile DCPUState* st = &m_state;
-	volatile uint32_t oldCycles = m_state.info.cycles;
 	if(m_state.info.cycles < 0) return false;
+	int64_t oldCycles = m_state.info.cycles;
+
+	uint8_t* link = NULL;
+	m_state.info.idle = 0;
+	if(interpreted != NULL) {
+		// Interrupts are polled for the same way compiled code does it
+		bool perInsn = (m_options.cycleMode == JIT_CYCLES_PER_INSN);
+		if(perInsn || m_state.info.interruptsPending == 0 || !m_state.pollInterrupts())
+			interpretBlock(m_state, interpreted->decoded, perInsn, m_insnCounts);
+	} else {
+		// Run the block at the instruction pointer, and whatever compiled
+		// code follows it. If the dispatcher stopped at a chainable exit,
+		// the address of its jump comes back.
+		link = m_dispatcher(&m_state.info);
+	}
+	m_state.elapsed += oldCycles - m_state.info.cycles;
 
-	// Execute the code at the instruction pointer
-	dcpu64Func fptr = m_codeCache[m_state.info.pc];
-	
-	// Set up the environment for the compiled code and jump to it
-	// This block:
-	//	Pushes all registers
-	//	Sets up the state info in rdi
-	//	Calls the compiled code
-	//	Restores registers
-	asm volatile(
-			"push %%rax\n\t"
-			"push %%rbx\n\t"
-			"push %%rcx\n\t"
-			"push %%rdx\n\t"
-			"push %%rsi\n\t"
-			"push %%rdi\n\t"
-			"mov %1, %%rdi\n\t"
-			"call *%0\n\r"
-			"pop %%rdi\n\t"
-			"pop %%rsi\n\t"
-			"pop %%rdx\n\t"
-			"pop %%rcx\n\t"
-			"pop %%rbx\n\t"
-			"pop %%rax\n\t"
-			:
-			: "r"(fptr), "r"(&(m_state.info))
-			);
-	m_state.elapsed += (((int64_t)oldCycles)-st->info.cycles);
-	if(m_state.isr) {
-		if(m_state.interruptQueue.size() > 256) {
-			// Halt and Catch Fire
-			m_state.ignited = true;
-			return false;
-		}
-		// Handle one interrupt
-		m_state.isr = false;
-		uint16_t interrupt = m_state.interruptQueue.front();
-		m_state.interruptQueue.pop();
+	m_state.info.codeInvalidated = 0;
 
-		// Push PC and A to the stack
+	// A block that ran out its count left before running anything
+	if(m_state.info.blockHot) {
+		m_state.info.blockHot = 0;
+		promoteBlock(m_state.info.pc);
+	}
+
+	// Patch the exit to jump straight into its target next time
+	if(link != NULL && !m_state.isr)
+		linkBlock(link, m_state.info.pc);
+
+	uint16_t interrupt;
+	if(m_state.isr && m_state.nextInterrupt(interrupt)) {
+		// Handle one interrupt. Push PC and A to the stack
 		m_state.info.memory[--m_state.info.sp] = m_state.info.pc;
 		m_state.info.memory[--m_state.info.sp] = m_state.info.a;
+		m_state.memoryWritten(m_state.info.sp, 2);
 
 		// Set up the environment for the interrupt handler
 		m_state.info.a = interrupt;
 		m_state.info.pc = m_state.info.ia;
 		m_state.info.queueInterrupts = true;
+		m_state.info.idle = 0;
 	}
+	m_state.isr = false;
 	return true;
 }
 
 void emitSET(Assembler& s, DCPUInsn inst, CodeGenState& cgs) {
 	if(inst.a.val == DCPUValue::VT_LITERAL) {
 		// Shortcircuit
-		emitDCPUPut(s, inst.b, inst.a.nextWord);
+		emitDCPUPut(s, cgs, inst.b, inst.a.nextWord);
 	} else {
-		emitDCPUFetch(s, inst.a, ax, false);
-		emitDCPUPut(s, inst.b, ax);
+		emitDCPUFetch(s, cgs, inst.a, ax, false);
+		emitDCPUPut(s, cgs, inst.b, ax);
 	}
 }
 
 void emitADD(Assembler& s, DCPUInsn inst, CodeGenState& cgs) {
-	emitDCPUFetch(s, inst.b, eax);
-	emitDCPUFetch(s, inst.a, ebx);
-	s.add(eax, ebx);
-	emitDCPUPut(s, inst.b, ax);
-	dcpuEmitCarry(s, 1);
+	emitDCPUFetch(s, cgs, inst.b, eax);
+	emitDCPUFetch(s, cgs, inst.a, r11d);
+	s.add(eax, r11d);
+
+	// Both operands are zero-extended, so the carry ends up in bit 16
+	if(!cgs.exDead) {
+		s.mov(edx, eax);
+		s.shr(edx, 16);
+	}
+	emitDCPUPut(s, cgs, inst.b, ax);
+	emitOverflowStore(s, cgs, dx);
 }
 
 void emitSUB(Assembler& s, DCPUInsn inst, CodeGenState& cgs) {
-	emitDCPUFetch(s, inst.a, ebx);
-	emitDCPUFetch(s, inst.b, eax);
-	s.sub(eax, ebx);
-	emitDCPUPut(s, inst.b, ax);
-	dcpuEmitCarry(s, 0xffff);
+	emitDCPUFetch(s, cgs, inst.a, r11d);
+	emitDCPUFetch(s, cgs, inst.b, eax);
+	s.sub(eax, r11d);
+
+	// A borrow leaves the high half all ones, giving EX = 0xffff
+	if(!cgs.exDead) {
+		s.mov(edx, eax);
+		s.sar(edx, 16);
+	}
+	emitDCPUPut(s, cgs, inst.b, ax);
+	emitOverflowStore(s, cgs, dx);
+}
+
+// Division and multiplication by literals. Guest code divides by constants
+// all the time, for number formatting and packing bits, and div is slow.
+
+// The shift that multiplies by a power of two, or -1 for anything else
+int literalShift(uint16_t value) {
+	if(value == 0 || (value & (value - 1)) != 0) return -1;
+	return __builtin_ctz(value);
+}
+
+// Divide eax by a nonzero literal, leaving the quotient in eax. The top
+// half of eax times ceil(2^64 / divisor) is the quotient exactly for every
+// 32-bit eax, since the rounding error stays below 2^48 / 2^64. Clobbers
+// rcx and rdx.
+void emitDivideByLiteral(Assembler& s, uint16_t divisor) {
+	int shift = literalShift(divisor);
+	if(shift >= 0) {
+		if(shift != 0)
+			s.shr(eax, shift);
+		return;
+	}
+	s.mov(rcx, (sysint_t)(~(uint64_t)0 / divisor + 1));
+	s.mul(rcx);
+	s.mov(eax, edx);
 }
 
 void emitMUL(Assembler& s, DCPUInsn inst, CodeGenState& cgs) {
-	emitDCPUFetch(s, inst.a, ebx);
-	emitDCPUFetch(s, inst.b, eax);
-	
-	// Multiply ax by bx, store lower part in ax and higher part in dx
-	s.mul(bx);
+	int shift = (inst.a.val == DCPUValue::VT_LITERAL) ? literalShift(inst.a.nextWord) : -1;
+	if(shift >= 0) {
+		// The bits shifted past the low word go in EX, like SHL
+		emitDCPUFetch(s, cgs, inst.b, eax);
+		if(shift != 0)
+			s.shl(eax, shift);
+		emitDCPUPut(s, cgs, inst.b, ax);
+		if(!cgs.exDead) {
+			s.shr(eax, 16);
+			emitOverflowStore(s, cgs, ax);
+		}
+		return;
+	}
+
+	emitDCPUFetch(s, cgs, inst.a, r11d);
+	emitDCPUFetch(s, cgs, inst.b, eax);
 	
-	// Store the overflow first, since edx is a discretionary register
-	// we don't want our result clobbered before we have the chance to
-	// store it in the DCPU's register
-	s.mov(word_ptr(rdi, 2*10), dx);
+	// Multiply ax by r11w, store lower part in ax and higher part in dx
+	s.mul(r11w);
 	
-	// And store the lower part of the output
-	emitDCPUPut(s, inst.b, ax);
+	// Store the lower part of the output, then the overflow. Storing to b
+	// leaves edx alone.
+	emitDCPUPut(s, cgs, inst.b, ax);
+	emitOverflowStore(s, cgs, dx);
 }
 
 void emitMLI(Assembler& s, DCPUInsn inst, CodeGenState& cgs) {
 	// Same as MUL, but using imul instead of mul. Also, we have to sign-extend
 	// the multiplicands when fetching them from memory.
-	emitDCPUFetch(s, inst.a, ebx, false, true);
-	emitDCPUFetch(s, inst.b, eax, false, true);
+	emitDCPUFetch(s, cgs, inst.a, r11d, false, true);
+	emitDCPUFetch(s, cgs, inst.b, eax, false, true);
 
 	// Actually multiply
-	s.imul(bx);
+	s.imul(r11w);
 
-	// Store the results back. Store the overflow first, since DCPUPut can use
-	// dx for scratch space and I want to avoid the overhead of a push/pop pair. Also
-	// this is easier.
-	s.mov(word_ptr(rdi, 2*10), dx);
+	// Store the result, then the overflow
+	emitDCPUPut(s, cgs, inst.b, ax);
+	emitOverflowStore(s, cgs, dx);
+}
 
-	// Now store the final result
-	emitDCPUPut(s, inst.b, ax);
+// EX is the low word of (b << 16) / a, and the result its high word
+void emitDIVLiteral(Assembler& s, DCPUInsn inst, CodeGenState& cgs) {
+	emitDCPUFetch(s, cgs, inst.b, eax);
+	s.shl(eax, 16);
+	emitDivideByLiteral(s, inst.a.nextWord);
+	s.mov(edx, eax);
+	s.shr(edx, 16);
+	emitDCPUPut(s, cgs, inst.b, dx);
+	emitOverflowStore(s, cgs, ax);
 }
 
 void emitDIV(Assembler& s, DCPUInsn inst, CodeGenState& cgs) {
-	emitDCPUFetch(s, inst.a, ebx);
-	emitDCPUFetch(s, inst.b, eax);
+	if(inst.a.val == DCPUValue::VT_LITERAL && inst.a.nextWord != 0) {
+		emitDIVLiteral(s, inst, cgs);
+		return;
+	}
+	emitDCPUFetch(s, cgs, inst.a, r11d);
+	emitDCPUFetch(s, cgs, inst.b, eax);
 	
 	// Build a label for zero-checking
 	Label doneLbl = s.newLabel();
 
-	// Set up the division operation and check for division by zero
-	s.mov(ecx, eax); // Store B value
+	// Division by zero sets both b and EX to zero
 	s.xor_(edx, edx); // The second part can be zeroed since unsigned division
-	s.cmp(ebx, edx);
+	s.xor_(ecx, ecx);
+	s.test(r11d, r11d);
 	s.cmove(eax, edx);
 	s.je(doneLbl);
 
-	// Divide to generate the EX value
-	s.shl(eax, 16); // Shift 16 to compute the EX value
-	s.div(ebx); // Get the new value for the EX register
-	
-	// Update EX register
-	s.mov(word_ptr(rdi, 2*10), ax);
-	
+	if(!cgs.exDead) {
+		// Divide b << 16 to get the EX value into ecx
+		s.mov(ecx, eax);
+		s.shl(eax, 16);
+		s.div(r11d);
+		s.xchg(eax, ecx);
+		s.xor_(edx, edx);
+	}
+
 	// Divide for B register
-	s.mov(eax, ecx);
-	s.xor_(edx, edx);
-	s.div(ebx); // Get the new value for the B register
+	s.div(r11d);
 	s.bind(doneLbl);
-	emitDCPUPut(s, inst.b, ax);
+	emitDCPUPut(s, cgs, inst.b, ax);
+	emitOverflowStore(s, cgs, cx);
 }
 
 // Sign-extend eax into edx
@@ -620,102 +1398,180 @@ inline void emitSignExtend(Assembler& s) {
 	s.sar(edx, 31);
 }
 
+// Sign-extend rax into rdx
+inline void emitSignExtend64(Assembler& s) {
+	s.mov(rdx, rax);
+	s.sar(rdx, 63);
+}
+
+// Make eax its absolute value, leaving its sign in edx as 0 or -1
+void emitAbsolute(Assembler& s) {
+	emitSignExtend(s);
+	s.xor_(eax, edx);
+	s.sub(eax, edx);
+}
+
+// Negate reg if sign is -1, and leave it alone if it's 0
+void emitApplySign(Assembler& s, const GPReg& reg, const GPReg& sign) {
+	s.xor_(reg, sign);
+	s.sub(reg, sign);
+}
+
+// Like emitDIVLiteral, on magnitudes. Both results round toward zero, so
+// they take the sign of the quotient afterwards.
+void emitDVILiteral(Assembler& s, DCPUInsn inst, CodeGenState& cgs) {
+	int16_t divisor = (int16_t)inst.a.nextWord;
+	emitDCPUFetch(s, cgs, inst.b, eax, false, true);
+	s.shl(eax, 16);
+	emitAbsolute(s);
+	s.mov(r9d, edx);
+	if(divisor < 0)
+		s.not_(r9d);
+	emitDivideByLiteral(s, (divisor < 0) ? -divisor : divisor);
+	s.mov(ecx, eax);
+	s.shr(ecx, 16);
+	emitApplySign(s, ecx, r9d);
+	// Storing to memory clobbers r9, so EX takes its sign first
+	if(!cgs.exDead)
+		emitApplySign(s, eax, r9d);
+	emitDCPUPut(s, cgs, inst.b, cx);
+	if(!cgs.exDead)
+		emitOverflowStore(s, cgs, ax);
+}
+
 void emitDVI(Assembler& s, DCPUInsn inst, CodeGenState& cgs) {
-	emitDCPUFetch(s, inst.a, ebx, false, true);
-	emitDCPUFetch(s, inst.b, eax, false, true);
+	if(inst.a.val == DCPUValue::VT_LITERAL && inst.a.nextWord != 0) {
+		emitDVILiteral(s, inst, cgs);
+		return;
+	}
+	emitDCPUFetch(s, cgs, inst.a, r11d, false, true);
+	emitDCPUFetch(s, cgs, inst.b, eax, false, true);
 
 	// Build a label for zero-checking
 	Label doneLbl = s.newLabel();
 
-	// Check for division by zero
+	// Division by zero sets both b and EX to zero
 	s.xor_(edx, edx);
-	s.cmp(ebx, 0);
+	s.xor_(ecx, ecx);
+	s.test(r11d, r11d);
 	s.cmove(eax, edx);
 	s.je(doneLbl);
 
-	// Sign-extend eax into edx
-	s.mov(ecx, eax);
-	s.shl(eax, 16);
-	emitSignExtend(s);
-	
-	// Divide edx:eax by ebx
-	s.idiv(ebx);
-
-	// Update EX register
-	s.mov(word_ptr(rdi, 2*10), ax);
-	
-	// Sign-extend for B register division
-	s.mov(eax, ecx);
-	emitSignExtend(s);
+	// Divide in 64 bits, since 0x8000 << 16 divided by -1 doesn't fit in
+	// 32 and would fault
+	s.movsxd(rax, eax);
+	s.movsxd(r11, r11d);
+	if(!cgs.exDead) {
+		// Divide b << 16 to get the EX value into ecx
+		s.mov(rcx, rax);
+		s.shl(rax, 16);
+		emitSignExtend64(s);
+		s.idiv(r11);
+		s.xchg(rax, rcx);
+	}
 
 	// Divide for B
-	s.idiv(ebx);
+	emitSignExtend64(s);
+	s.idiv(r11);
 	s.bind(doneLbl);
-	emitDCPUPut(s, inst.b, ax);
+	emitDCPUPut(s, cgs, inst.b, ax);
+	emitOverflowStore(s, cgs, cx);
+}
+
+// The remainder is b less the quotient times a, or just b's low bits when
+// a is a power of two. Leaves it in r9d, with the magnitude of b in eax.
+void emitRemainderByLiteral(Assembler& s, uint16_t divisor) {
+	s.mov(r9d, eax);
+	if(literalShift(divisor) >= 0) {
+		s.and_(r9d, divisor - 1);
+		return;
+	}
+	emitDivideByLiteral(s, divisor);
+	s.imul(eax, eax, divisor);
+	s.sub(r9d, eax);
 }
 
 void emitMOD(Assembler& s, DCPUInsn inst, CodeGenState& cgs) {
-	emitDCPUFetch(s, inst.a, ebx);
-	emitDCPUFetch(s, inst.b, eax);
+	if(inst.a.val == DCPUValue::VT_LITERAL && inst.a.nextWord != 0) {
+		emitDCPUFetch(s, cgs, inst.b, eax);
+		emitRemainderByLiteral(s, inst.a.nextWord);
+		emitDCPUPut(s, cgs, inst.b, r9w);
+		return;
+	}
+	emitDCPUFetch(s, cgs, inst.a, r11d);
+	emitDCPUFetch(s, cgs, inst.b, eax);
 	
 	// Build a label for zero-checking
 	Label doneLbl = s.newLabel();
 
-	// Set up the division operation and check for division by zero
-	s.cmp(ebx, 0);
+	// Set up the division operation and check for division by zero. The
+	// result is zero in that case, so edx is cleared before the check.
+	s.xor_(edx, edx); // Zero the second part since we're doing unsigned division
+	s.cmp(r11d, 0);
 	s.je(doneLbl);
 
 	// Divide to generate modulus in edx
-	s.xor_(edx, edx); // Zero the second part since we're doing unsigned division
-	s.div(ebx); // Get the new value for the B register
+	s.div(r11d); // Get the new value for the B register
 	s.bind(doneLbl);
-	emitDCPUPut(s, inst.b, dx);
+	emitDCPUPut(s, cgs, inst.b, dx);
 }
 
 void emitMDI(Assembler& s, DCPUInsn inst, CodeGenState& cgs) {
-	emitDCPUFetch(s, inst.a, ebx, false, true);
-	emitDCPUFetch(s, inst.b, eax, false, true);
+	if(inst.a.val == DCPUValue::VT_LITERAL && inst.a.nextWord != 0) {
+		// The remainder takes the sign of b, whatever a's is
+		int16_t divisor = (int16_t)inst.a.nextWord;
+		emitDCPUFetch(s, cgs, inst.b, eax, false, true);
+		emitAbsolute(s);
+		s.mov(esi, edx);
+		emitRemainderByLiteral(s, (divisor < 0) ? -divisor : divisor);
+		emitApplySign(s, r9d, esi);
+		emitDCPUPut(s, cgs, inst.b, r9w);
+		return;
+	}
+	emitDCPUFetch(s, cgs, inst.a, r11d, false, true);
+	emitDCPUFetch(s, cgs, inst.b, eax, false, true);
 
 	// Build a label for zero-checking
 	Label doneLbl = s.newLabel();
 
-	// Check for division by zero
-	s.cmp(ebx, 0);
+	// Check for division by zero, which leaves a zero result
+	s.xor_(edx, edx);
+	s.cmp(r11d, 0);
 	s.je(doneLbl);
 
-	// Divide eax by ebx, storing remainder in edx
+	// Divide eax by r11d, storing remainder in edx
 	emitSignExtend(s);
-	s.idiv(ebx);
+	s.idiv(r11d);
 
 	// Store results
 	s.bind(doneLbl);
-	emitDCPUPut(s, inst.b, dx);
+	emitDCPUPut(s, cgs, inst.b, dx);
 }
 
 void emitAND(Assembler& s, DCPUInsn inst, CodeGenState& cgs) {
-	emitDCPUFetch(s, inst.a, eax);
-	emitDCPUFetch(s, inst.b, ebx);
-	s.and_(eax, ebx);
-	emitDCPUPut(s, inst.b, ax);
+	emitDCPUFetch(s, cgs, inst.a, eax);
+	emitDCPUFetch(s, cgs, inst.b, r11d);
+	s.and_(eax, r11d);
+	emitDCPUPut(s, cgs, inst.b, ax);
 }
 
 void emitBOR(Assembler& s, DCPUInsn inst, CodeGenState& cgs) {
-	emitDCPUFetch(s, inst.a, eax);
-	emitDCPUFetch(s, inst.b, ebx);
-	s.or_(eax, ebx);
-	emitDCPUPut(s, inst.b, ax);
+	emitDCPUFetch(s, cgs, inst.a, eax);
+	emitDCPUFetch(s, cgs, inst.b, r11d);
+	s.or_(eax, r11d);
+	emitDCPUPut(s, cgs, inst.b, ax);
 }
 
 void emitXOR(Assembler& s, DCPUInsn inst, CodeGenState& cgs) {
-	emitDCPUFetch(s, inst.a, eax);
-	emitDCPUFetch(s, inst.b, ebx);
-	s.xor_(eax, ebx);
-	emitDCPUPut(s, inst.b, ax);
+	emitDCPUFetch(s, cgs, inst.a, eax);
+	emitDCPUFetch(s, cgs, inst.b, r11d);
+	s.xor_(eax, r11d);
+	emitDCPUPut(s, cgs, inst.b, ax);
 }
 
 void emitSHR(Assembler& s, DCPUInsn inst, CodeGenState& cgs) {
-	emitDCPUFetch(s, inst.a, ecx);
-	emitDCPUFetch(s, inst.b, eax);
+	emitDCPUFetch(s, cgs, inst.a, ecx);
+	emitDCPUFetch(s, cgs, inst.b, eax);
 
 	// Perform the actual shift operation
 	s.shl(eax, 16);
@@ -724,178 +1580,525 @@ void emitSHR(Assembler& s, DCPUInsn inst, CodeGenState& cgs) {
 
 	// Emit the actual output value
 	s.shr(edx, 16);
-	emitDCPUPut(s, inst.b, dx);
+	emitDCPUPut(s, cgs, inst.b, dx);
 
-	// Clip to the shifted bits and put them in EX
-	s.and_(eax, 0xffff);
-	dcpuEmitSpecialWrite(s, DCPUValue::VT_EX);
+	// The shifted out bits go in EX
+	emitOverflowStore(s, cgs, ax);
 }
 
 void emitASR(Assembler& s, DCPUInsn inst, CodeGenState& cgs) {
-	emitDCPUFetch(s, inst.a, ecx); // Don't zero-extend this because you can't shift negative
-	emitDCPUFetch(s, inst.b, eax, false, true);
+	emitDCPUFetch(s, cgs, inst.a, ecx); // Don't zero-extend this because you can't shift negative
+	emitDCPUFetch(s, cgs, inst.b, eax, false, true);
 
 	// Perform the normal shift operation and output the result
 	s.mov(edx, eax);
 	s.sar(edx, cl);
-	emitDCPUPut(s, inst.b, dx);
+	emitDCPUPut(s, cgs, inst.b, dx);
 
 	// Generate the value for EX and store it
-	s.shl(eax, 16);
-	s.sar(eax, cl);
-	s.and_(eax, 0xffff);
-	dcpuEmitSpecialWrite(s, DCPUValue::VT_EX);
+	if(!cgs.exDead) {
+		s.shl(eax, 16);
+		s.sar(eax, cl);
+		emitOverflowStore(s, cgs, ax);
+	}
 }
 
 void emitSHL(Assembler& s, DCPUInsn inst, CodeGenState& cgs) {
-	emitDCPUFetch(s, inst.a, ecx);
-	emitDCPUFetch(s, inst.b, eax);
+	emitDCPUFetch(s, cgs, inst.a, ecx);
+	emitDCPUFetch(s, cgs, inst.b, eax);
 
 	// Perform the actual shift operation
 	s.shl(eax, cl);
 
 	// Emit the actual output value
-	emitDCPUPut(s, inst.b, ax);
+	emitDCPUPut(s, cgs, inst.b, ax);
 
-	// Clip to the shifted bits and put them in EX
-	s.shr(eax, 16);
-	s.and_(eax, 0xffff);
-	dcpuEmitSpecialWrite(s, DCPUValue::VT_EX);
+	// The bits shifted past the low word go in EX
+	if(!cgs.exDead) {
+		s.shr(eax, 16);
+		emitOverflowStore(s, cgs, ax);
+	}
 }
 
 void emitADX(Assembler& s, DCPUInsn inst, CodeGenState& cgs) {
-	emitDCPUFetch(s, inst.a, ebx);
-	emitDCPUFetch(s, inst.b, ecx);
-	dcpuEmitSpecialRead(s, DCPUValue::VT_EX);
+	emitDCPUFetch(s, cgs, inst.a, r11d);
+	emitDCPUFetch(s, cgs, inst.b, ecx);
+	emitSlotLoad(s, cgs, SLOT_EX, eax);
 	
 	// Since we're operating in 32-bit ints we can ignore overflow
-	s.add(ebx, ecx);
-	s.add(ebx, eax);
-
-	// Store the result back from ebx
-	emitDCPUPut(s, inst.b, ebx);
-
-	// Compute the value for EX
-	s.xor_(eax, eax);
-	s.mov(ecx, 1);
-	s.shr(ebx, 16);
-	s.and_(ebx, 0xffff);
-	s.cmovnz(eax, ecx);
-	dcpuEmitSpecialWrite(s, DCPUValue::VT_EX);
+	s.add(r11d, ecx);
+	s.add(r11d, eax);
+
+	// Store the result back from r11d
+	emitDCPUPut(s, cgs, inst.b, r11d);
+
+	// EX is 1 if anything carried past the low word
+	if(!cgs.exDead) {
+		s.xor_(eax, eax);
+		s.test(r11d, 0xffff0000);
+		s.setnz(al);
+		emitOverflowStore(s, cgs, ax);
+	}
 }
 
 void emitSBX(Assembler& s, DCPUInsn inst, CodeGenState& cgs) {
-	emitDCPUFetch(s, inst.a, ebx);
-	emitDCPUFetch(s, inst.b, ecx);
-	dcpuEmitSpecialRead(s, DCPUValue::VT_EX);
+	emitDCPUFetch(s, cgs, inst.a, r11d);
+	emitDCPUFetch(s, cgs, inst.b, ecx);
+	emitSlotLoad(s, cgs, SLOT_EX, eax);
 
 	// Since we're operating in 32-bit ints we can ignore overflow
 	// as long as we shift the operands around a little
 	s.add(ecx, eax);
-	s.sub(ecx, ebx);
-
-	emitDCPUPut(s, inst.b, ecx);
+	s.sub(ecx, r11d);
 
-	// Write the result into EX
-	s.mov(ebx, 0xffff);
-	s.mov(eax, 0);
-	s.cmovc(eax, ebx);
-	dcpuEmitSpecialWrite(s, DCPUValue::VT_EX);
+	// The result lies in [-0xffff, 0x1fffe], so its high half is -1 on
+	// underflow and 1 on overflow, which is what EX gets
+	if(!cgs.exDead) {
+		s.mov(edx, ecx);
+		s.sar(edx, 16);
+	}
+	emitDCPUPut(s, cgs, inst.b, ecx);
+	emitOverflowStore(s, cgs, dx);
 }
 
 void emitSTI(Assembler& s, DCPUInsn inst, CodeGenState& cgs) {
 	emitSET(s, inst, cgs);
-	s.add(word_ptr(rdi, 12), 1);
-	s.add(word_ptr(rdi, 14), 1);
+	emitSlotLoad(s, cgs, DCPUValue::I, eax);
+	s.inc(eax);
+	emitSlotStore(s, cgs, DCPUValue::I, eax);
+	emitSlotLoad(s, cgs, DCPUValue::J, eax);
+	s.inc(eax);
+	emitSlotStore(s, cgs, DCPUValue::J, eax);
 }
 
 void emitSTD(Assembler& s, DCPUInsn inst, CodeGenState& cgs) {
 	emitSET(s, inst, cgs);
-	s.sub(word_ptr(rdi, 12), 1);
-	s.sub(word_ptr(rdi, 14), 1);
+	emitSlotLoad(s, cgs, DCPUValue::I, eax);
+	s.dec(eax);
+	emitSlotStore(s, cgs, DCPUValue::I, eax);
+	emitSlotLoad(s, cgs, DCPUValue::J, eax);
+	s.dec(eax);
+	emitSlotStore(s, cgs, DCPUValue::J, eax);
 }
 
-void emitHWN(Assembler& s, DCPUInsn inst, CodeGenState cgs) {
-	s.call((void*)&hardwareNumberQuery);
-	emitDCPUPut(s, inst.a, eax);
+// The hardware proxies are called with rdi pushed, which also keeps the stack
+// 16-byte aligned for the call.
+void emitHWN(Assembler& s, DCPUInsn inst, CodeGenState& cgs) {
+	s.push(rdi);
+	emitHelperCall(s, JIT_TABLE_HARDWARE_NUMBER);
+	s.pop(rdi);
+	emitDCPUPut(s, cgs, inst.a, ax);
 }
 
-void emitHWQ(Assembler& s, DCPUInsn inst, CodeGenState cgs) {
-	emitDCPUFetch(s, inst.a, rsi);
-	s.call((void*)&hardwareQuery);
-	emitDCPUPut(s, inst.a, eax);
+void emitHWQ(Assembler& s, DCPUInsn inst, CodeGenState& cgs) {
+	// The query writes A, B, C, X and Y directly, so any of them held in
+	// host registers have to be picked up again afterwards. They're stored
+	// first, since a query of missing hardware leaves them alone.
+	emitDCPUFetch(s, cgs, inst.a, esi);
+	emitSpill(s, cgs);
+	s.push(rdi);
+	emitHelperCall(s, JIT_TABLE_HARDWARE_QUERY);
+	s.pop(rdi);
+	emitReload(s, cgs, DCPUValue::A, DCPUValue::Y);
 }
 
-void emitHWI(Assembler& s, DCPUInsn inst, CodeGenState cgs) {
+void emitHWI(Assembler& s, DCPUInsn inst, CodeGenState& cgs) {
 	// We have to return after executing an interrupt, because they
 	// can modify arbitrary addresses or registers (including PC). Therefore
 	// we need to go back to the JITProcessor wrapper so code invalidation
-	// is handled properly.
-	emitDCPUFetch(s, inst.a, rsi);
-	s.call((void*)&hardwareInterrupt);
-	emitCostCycles(s, eax);
+	// is handled properly. Devices report their memory writes through
+	// DCPUState::memoryWritten. The device sees the registers in
+	// DCPURegisterInfo, and nothing is stored back after it returns.
+	emitDCPUFetch(s, cgs, inst.a, esi);
+	emitSpill(s, cgs);
+	s.push(rdi);
+	emitHelperCall(s, JIT_TABLE_HARDWARE_INTERRUPT);
+	s.pop(rdi);
+	s.movzx(eax, ax);
+	emitCostCycles(s, rax);
 	emitDCPUSetPC(s, inst.nextOffset);
+	emitRefund(s, cgs);
 	emitFooter(s);
 }
 
-void emitJSR(Assembler& s, DCPUInsn inst, CodeGenState cgs) {
-	// Push PC
-	static DCPUValue push;
+// Push the return address of a JSR
+void emitReturnPush(Assembler& s, DCPUInsn inst, CodeGenState& cgs) {
+	DCPUValue push = DCPUValue();
 	push.val = DCPUValue::VT_PUSHPOP;
 	push.b = true;
-	dcpuEmitSpecialRead(s, DCPUValue::VT_PC);
-	emitDCPUPut(s, push, ax);
+	emitDCPUPut(s, cgs, push, inst.nextOffset);
+}
 
-	// Read the new value for PC
-	emitDCPUFetch(s, inst.a, eax);
-	dcpuEmitSpecialWrite(s, DCPUValue::VT_PC);
+// Push the return address of a JSR to the shadow return stack, with whatever
+// code is cached for it when the JSR runs. Preserves everything but rcx, r9
+// and r10.
+void emitShadowPush(Assembler& s, DCPUInsn inst, CodeGenState& cgs) {
+	emitTableLoad(s, r9, JIT_TABLE_RETURN_STACK);
+	s.mov(ecx, dword_ptr(r9));
+	s.inc(ecx);
+	s.and_(ecx, JIT_RETURN_STACK_SIZE-1);
+	s.mov(dword_ptr(r9), ecx);
+	s.shl(ecx, 4);
+	s.mov(dword_ptr(r9, rcx, 0, 8), inst.nextOffset);
+	emitTableLoad(s, r10, JIT_TABLE_CODE_CACHE);
+	s.mov(r10, qword_ptr(r10, sizeof(dcpu64Func)*inst.nextOffset));
+	s.mov(qword_ptr(r9, rcx, 0, 16), r10);
 }
 
-void emitIAQ(Assembler& s, DCPUInsn inst, CodeGenState cgs) {
-	emitDCPUFetch(s, inst.a, eax);
-	s.mov(al, byte_ptr(rdi, 0x29));
+// Continue at the new PC through the lookup stub, with r9 holding the cache
+// to fill, or 0
+void emitLookupJump(Assembler& s) {
+	s.movzx(eax, word_ptr(rdi, 0x10));
+	s.mov(r10, qword_ptr(rdi, 0x40));
+	s.jmp(qword_ptr(r10, sizeof(void*)*JIT_TABLE_LOOKUP_STUB));
 }
 
-void emitIAG(Assembler& s, DCPUInsn inst, CodeGenState cgs) {
-	s.movzx(eax, word_ptr(rdi, 0x16));
-	emitDCPUPut(s, inst.a, eax);
+// Leave the block after a SET PC, POP. If the new PC is the return address on
+// top of the shadow stack and there was code for it, jump straight there,
+// checking the budget like chained jumps do. Otherwise look the code up.
+void emitReturnExit(Assembler& s, CodeGenState& cgs) {
+	Label miss = s.newLabel();
+	emitRefund(s, cgs);
+	emitSpill(s, cgs);
+
+	// Pop the prediction whether or not it's right, so the shadow stack
+	// stays in step with the guest's
+	emitTableLoad(s, r9, JIT_TABLE_RETURN_STACK);
+	s.mov(ecx, dword_ptr(r9));
+	s.lea(edx, dword_ptr(rcx, -1));
+	s.and_(edx, JIT_RETURN_STACK_SIZE-1);
+	s.mov(dword_ptr(r9), edx);
+	s.shl(ecx, 4);
+
+	s.movzx(eax, word_ptr(rdi, 0x10));
+	s.cmp(dword_ptr(r9, rcx, 0, 8), eax);
+	s.jne(miss);
+	s.mov(rdx, qword_ptr(r9, rcx, 0, 16));
+	s.test(rdx, rdx);
+	s.jz(miss);
+	s.cmp(qword_ptr(rdi, 0x18), 0);
+	s.jl(miss);
+	s.jmp(rdx);
+
+	s.bind(miss);
+	s.xor_(r9d, r9d);
+	emitLookupJump(s);
+}
+
+// Leave the block after a jump to a computed target, through an inline cache
+// of the targets the jump has taken before. The cache itself is emitted after
+// the block by emitBranchCaches.
+void emitIndirectExit(Assembler& s, CodeGenState& cgs, DCPUInsn inst) {
+	emitRefund(s, cgs);
+	emitSpill(s, cgs);
+
+	// Recompiled blocks check for the target the jump took last, and
+	// chain straight to it
+	if(cgs.traceProfile != NULL) {
+		std::map<uint16_t, uint16_t>::const_iterator target =
+			cgs.traceProfile->jumpTargets.find(inst.offset);
+		if(target != cgs.traceProfile->jumpTargets.end()) {
+			Label other = s.newLabel();
+			s.cmp(word_ptr(rdi, 0x10), target->second);
+			s.jne(other);
+			emitChainJump(s, cgs);
+			s.bind(other);
+		}
+	}
+
+	// lea r9, [rip+disp32], with the displacement filled in once the cache
+	// has been placed
+	s.db(0x4c);
+	s.db(0x8d);
+	s.db(0x0d);
+	cgs.branchCacheRefs.push_back(std::make_pair(s.getOffset(), inst.offset));
+	s.dd(0);
+
+	// Budget checks on a hit are left to the lookup stub
+	Label miss = s.newLabel();
+	Label hit = s.newLabel();
+	s.movzx(eax, word_ptr(rdi, 0x10));
+	for(int w=0;w < JIT_BRANCH_CACHE_WAYS;w++) {
+		Label next = s.newLabel();
+		s.cmp(dword_ptr(r9, offsetof(JITBranchCache, pc) + 4*w), eax);
+		s.jne(next);
+		s.mov(rdx, qword_ptr(r9, offsetof(JITBranchCache, code) + 8*w));
+		s.jmp(hit);
+		s.bind(next);
+	}
+	s.jmp(miss);
+
+	s.bind(hit);
+	s.cmp(qword_ptr(rdi, 0x18), 0);
+	s.jl(miss);
+	if(cgs.profile)
+		s.inc(qword_ptr(r9, offsetof(JITBranchCache, hits)));
+	s.jmp(rdx);
+
+	s.bind(miss);
+	if(cgs.profile)
+		s.inc(qword_ptr(r9, offsetof(JITBranchCache, misses)));
+	emitLookupJump(s);
 }
 
-void emitIAS(Assembler& s, DCPUInsn inst, CodeGenState cgs) {
-	emitDCPUFetch(s, inst.a, eax);
-	s.mov(word_ptr(rdi, 0x16), ax);
+// Place the caches of the block's indirect jumps after its code, and point
+// the jumps at them
+void emitBranchCaches(Assembler& s, CodeGenState& cgs) {
+	for(size_t n=0;n < cgs.branchCacheRefs.size();n++) {
+		s.align(8);
+		sysint_t offset = s.getOffset();
+		sysint_t ref = cgs.branchCacheRefs[n].first;
+		s.setInt32At(ref, (int32_t)(offset - (ref + 4)));
+		cgs.branchCacheOffsets.push_back(offset);
+
+		JITBranchCache cache;
+		memset(&cache, 0, sizeof(cache));
+		for(int w=0;w < JIT_BRANCH_CACHE_WAYS;w++)
+			cache.pc[w] = JIT_RETURN_NONE;
+		cache.site = cgs.branchCacheRefs[n].second;
+		s.embed(&cache, sizeof(cache));
+	}
 }
 
-void queueInterrupt(DCPURegisterInfo* info, uint16_t n) {
-	DCPUState* s = (DCPUState*)info->statePtr;
-	s->interruptQueue.push(n);
+void emitJSR(Assembler& s, DCPUInsn inst, CodeGenState& cgs) {
+	emitReturnPush(s, inst, cgs);
+	emitShadowPush(s, inst, cgs);
+
+	// Read the new value for PC
+	emitDCPUFetch(s, cgs, inst.a, eax);
+	emitSlotStore(s, cgs, SLOT_PC, eax);
 }
 
-void emitINT(Assembler& s, DCPUInsn inst, CodeGenState cgs) {
+void emitIAQ(Assembler& s, DCPUInsn inst, CodeGenState& cgs) {
+	// Interrupts are queued up instead of taken while a is nonzero
+	emitDCPUFetch(s, cgs, inst.a, eax);
+	s.test(eax, eax);
+	s.setnz(byte_ptr(rdi, 0x29));
+}
+
+void emitIAG(Assembler& s, DCPUInsn inst, CodeGenState& cgs) {
+	emitSlotLoad(s, cgs, SLOT_IA, eax);
+	emitDCPUPut(s, cgs, inst.a, eax);
+}
+
+void emitIAS(Assembler& s, DCPUInsn inst, CodeGenState& cgs) {
+	emitDCPUFetch(s, cgs, inst.a, eax);
+	emitSlotStore(s, cgs, SLOT_IA, eax);
+}
+
+void emitINT(Assembler& s, DCPUInsn inst, CodeGenState& cgs) {
 	// Queue the given interrupt. RSI is the second parameter
-	emitDCPUFetch(s, inst.a, rsi);
-	s.call((void*)&queueInterrupt);
+	emitDCPUFetch(s, cgs, inst.a, rsi);
+	s.push(rdi);
+	emitHelperCall(s, JIT_TABLE_QUEUE_INTERRUPT);
+	s.pop(rdi);
 }
 
-void emitRFI(Assembler& s, DCPUInsn inst, CodeGenState cgs) {
+void emitRFI(Assembler& s, DCPUInsn inst, CodeGenState& cgs) {
 	// Disable interrupt queueing
 	s.mov(byte_ptr(rdi, 0x29), 0);
 
-	// Pop A and PC
-	static DCPUValue pop;
-	pop.val = DCPUValue::VT_PUSHPOP;
-	pop.b = false;
-	emitDCPUFetch(s, pop, eax);
-	emitDCPUFetch(s, pop, ebx);
+	// Pop A and PC
+	DCPUValue pop = DCPUValue();
+	pop.val = DCPUValue::VT_PUSHPOP;
+	pop.b = false;
+	emitDCPUFetch(s, cgs, pop, eax);
+	emitDCPUFetch(s, cgs, pop, r11d);
+
+	// Write A and PC back
+	emitSlotStore(s, cgs, DCPUValue::A, eax);
+	emitSlotStore(s, cgs, SLOT_PC, r11d);
+}
+
+// Leave the block after an instruction that wrote PC from its A value. Jumps
+// to a literal have a static target and can be chained, returns can use the
+// shadow stack, and anything else goes through an inline cache.
+void emitJumpExit(Assembler& s, CodeGenState& cgs, DCPUInsn inst) {
+	if(inst.a.val == DCPUValue::VT_LITERAL)
+		emitChainExit(s, cgs);
+	else if(inst.op == DO_SET && inst.a.val == DCPUValue::VT_PUSHPOP)
+		emitReturnExit(s, cgs);
+	else
+		emitIndirectExit(s, cgs, inst);
+}
+
+bool isConditionalSigned(DCPUInsn i) {
+	switch(i.op) {
+		case DO_IFA:
+		case DO_IFU:
+			return true;
+		default:
+			return false;
+	}
+}
+
+// The flags condition under which a test passes, after its operands are
+// compared the way emitConditional does
+CONDITION passCondition(DCPUInsn inst) {
+	switch(inst.op) {
+		case DO_IFB:
+			return C_NOT_ZERO;
+		case DO_IFC:
+			return C_ZERO;
+		case DO_IFE:
+			return C_EQUAL;
+		case DO_IFN:
+			return C_NOT_EQUAL;
+		case DO_IFG: // Unsigned
+			return C_ABOVE;
+		case DO_IFA: // Signed
+			return C_GREATER;
+		case DO_IFL: // Unsigned
+			return C_BELOW;
+		default: // IFU, signed
+			return C_LESS;
+	}
+}
+
+// Set the flags for a test, leaving passCondition(inst) true if it passes.
+// Clobbers eax and r11d.
+void emitCompare(Assembler& s, DCPUInsn inst, CodeGenState& cgs) {
+	bool isSigned = isConditionalSigned(inst);
+	emitDCPUFetch(s, cgs, inst.a, eax, !isSigned, isSigned);
+	emitDCPUFetch(s, cgs, inst.b, r11d, !isSigned, isSigned);
+	switch(inst.op) {
+		case DO_IFB:
+		case DO_IFC:
+			s.test(r11d, eax);
+			break;
+		default:
+			s.cmp(r11d, eax);
+	}
+}
+
+// The counts a recompiled block's profile has for the test at pc, or NULL
+const JITTestCounts* testProfile(const CodeGenState& cgs, uint16_t pc) {
+	if(cgs.traceProfile == NULL) return NULL;
+	std::map<uint16_t, JITTestCounts>::const_iterator counts = cgs.traceProfile->tests.find(pc);
+	if(counts == cgs.traceProfile->tests.end()) return NULL;
+	return &counts->second;
+}
+
+// Whether the test at pc went the same way at least 7 times in 8 while its
+// block's profile was taken. Tests that never ran don't count.
+bool testPredictable(const CodeGenState& cgs, uint16_t pc) {
+	const JITTestCounts* counts = testProfile(cgs, pc);
+	if(counts == NULL) return false;
+	uint64_t total = (uint64_t)counts->passed + counts->failed;
+	uint64_t most = std::max(counts->passed, counts->failed);
+	return total != 0 && 8*most >= 7*total;
+}
+
+void emitConditional(Assembler& s, DCPUInsn inst, CodeGenState& cgs, int32_t skipCost, uint32_t skipped) {
+	emitCompare(s, inst, cgs);
+
+	// Tests that mostly passed fall through into the body, and the skip
+	// goes after the block
+	const JITTestCounts* counts = testProfile(cgs, inst.offset);
+	if(counts != NULL && counts->passed > counts->failed) {
+		JITColdSkip cold;
+		cold.entry = s.newLabel();
+		cold.end = cgs.condEndLbl;
+		cold.cost = skipCost;
+		cold.pc = inst.offset;
+		cold.skipped = skipped;
+		s.j(negateCondition(passCondition(inst)), cold.entry);
+		cgs.coldSkips.push_back(cold);
+		return;
+	}
+
+	// localDontSkip, if jumped to, executes the condition's body
+	Label localDontSkip = s.newLabel();
+	s.j(passCondition(inst), localDontSkip);
+	if(cgs.countTests)
+		emitCount(s, JIT_TABLE_TEST_COUNTS, sizeof(JITTestCounts)*inst.offset + offsetof(JITTestCounts, failed));
+	if(cgs.profile)
+		emitTracepoint(s, inst.offset, 0, skipped);
+	if(skipCost != 0)
+		emitCostCycles(s, skipCost);
+	s.jmp(cgs.condEndLbl);
+	s.bind(localDontSkip);
+	if(cgs.countTests)
+		emitCount(s, JIT_TABLE_TEST_COUNTS, sizeof(JITTestCounts)*inst.offset + offsetof(JITTestCounts, passed));
+}
+
+// Place the skips moved out of line by emitConditional
+void emitColdSkips(Assembler& s, CodeGenState& cgs) {
+	for(size_t n=0;n < cgs.coldSkips.size();n++) {
+		s.bind(cgs.coldSkips[n].entry);
+		if(cgs.profile)
+			emitTracepoint(s, cgs.coldSkips[n].pc, 0, cgs.coldSkips[n].skipped);
+		if(cgs.coldSkips[n].cost != 0)
+			emitCostCycles(s, cgs.coldSkips[n].cost);
+		s.jmp(cgs.coldSkips[n].end);
+	}
+}
+
+// A test whose body only changes a register, done without branching. The
+// body's result is worked out first, and kept or dropped with cmov depending
+// on the test; so is the cycle correction a failed test makes. Only used
+// when the whole block was charged on entry, and see isSelectable for which
+// bodies qualify.
+void emitConditionalSelect(Assembler& s, DCPUInsn test, DCPUInsn body, CodeGenState& cgs, int32_t skipCost) {
+	// The result in ecx, and what was there before in esi
+	uint8_t slot = body.b.reg;
+	emitSlotLoad(s, cgs, slot, esi);
+	switch(body.op) {
+		case DO_SET:
+			emitDCPUFetch(s, cgs, body.a, ecx);
+			break;
+		case DO_ADD:
+			emitDCPUFetch(s, cgs, body.a, r9d);
+			s.mov(ecx, esi);
+			s.add(ecx, r9d);
+			break;
+		default: // SUB
+			emitDCPUFetch(s, cgs, body.a, r9d);
+			s.mov(ecx, esi);
+			s.sub(ecx, r9d);
+			break;
+	}
+
+	// EX in r9d, and its old value in r10d
+	bool setsEx = body.op != DO_SET && !cgs.exDead;
+	if(setsEx) {
+		s.mov(r9d, ecx);
+		if(body.op == DO_ADD)
+			s.shr(r9d, 16);
+		else
+			s.sar(r9d, 16);
+		emitSlotLoad(s, cgs, SLOT_EX, r10d);
+	}
+	if(skipCost != 0)
+		s.mov(rdx, (sysint_t)skipCost);
+
+	// Nothing from here to the last cmov may touch the flags
+	CONDITION cc = passCondition(test);
+	emitCompare(s, test, cgs);
+	s.cmov(cc, esi, ecx);
+	if(setsEx)
+		s.cmov(cc, r10d, r9d);
+	if(skipCost != 0) {
+		s.mov(eax, 0);
+		s.cmov(cc, rdx, rax);
+	}
 
-	// Write A and PC back
-	s.mov(word_ptr(rdi, 0x00), ax);
-	s.mov(word_ptr(rdi, 0x10), bx);
+	emitSlotStore(s, cgs, slot, si);
+	if(setsEx)
+		emitSlotStore(s, cgs, SLOT_EX, r10w);
+	if(skipCost != 0)
+		emitCostCycles(s, rdx);
 }
 
-bool isConditionalSigned(DCPUInsn i) {
-	switch(i.op) {
+bool isConditionalInsn(DCPUInsn inst) {
+	switch(inst.op) {
+		case DO_IFB:
+		case DO_IFC:
+		case DO_IFE:
+		case DO_IFN:
+		case DO_IFG:
 		case DO_IFA:
+		case DO_IFL:
 		case DO_IFU:
 			return true;
 		default:
@@ -903,177 +2106,634 @@ bool isConditionalSigned(DCPUInsn i) {
 	}
 }
 
-void emitConditional(Assembler& s, DCPUInsn inst, CodeGenState& cgs, uint32_t skipCost) {
-	bool isSigned = isConditionalSigned(inst);
-	emitDCPUFetch(s, inst.a, eax, !isSigned, isSigned);
-	emitDCPUFetch(s, inst.b, ebx, !isSigned, isSigned);
-	
-	// Compare the two
+// Returns true if executing the instruction may store to guest memory
+bool insnWritesMemory(DCPUInsn inst) {
+	if(isConditionalInsn(inst)) return false;
 	switch(inst.op) {
-		case DO_IFB:
-		case DO_IFC:
-			s.test(ebx, eax);
-			break;
+		case DO_JSR:
+			return true;
+		case DO_HWN:
+		case DO_IAG:
+			return isMemoryValue(inst.a);
+		case DO_INT:
+		case DO_IAS:
+		case DO_RFI:
+		case DO_IAQ:
+		case DO_HWQ:
+		case DO_HWI:
+		case DO_INVALID:
+			return false;
 		default:
-			s.cmp(ebx,eax);
+			return isMemoryValue(inst.b);
 	}
+}
 
-	// localDontSkip, if jumped to, executes the condition's body
-	Label localDontSkip = s.newLabel();
+// Returns true if the instruction has a b value. Special instructions only
+// have an a value, and their b is left undecoded.
+bool hasBValue(DCPUInsn inst) {
+	return inst.op <= DO_STD;
+}
+
+// Returns true if executing the instruction writes PC. These always end the
+// block, except when they can be skipped.
+bool insnWritesPC(DCPUInsn inst) {
+	if(isConditionalInsn(inst)) return false;
 	switch(inst.op) {
-		case DO_IFB:
-			s.jnz(localDontSkip);
+		case DO_JSR:
+		case DO_RFI:
+			return true;
+		case DO_HWN:
+		case DO_IAG:
+			return inst.a.val == DCPUValue::VT_PC;
+		case DO_INVALID:
+			return false;
+		default:
+			return hasBValue(inst) && inst.b.val == DCPUValue::VT_PC;
+	}
+}
+
+// Instructions after which a new block has to be started
+bool endsBlock(DCPUInsn inst) {
+	return insnWritesPC(inst) || inst.op == DO_HWI || inst.op == DO_INVALID;
+}
+
+// Returns true if the trace may carry on at the target of a jump instead of
+// ending there. Unconditional jumps and calls to a literal address are always
+// followed. Skippable ones are only followed backwards, since those are loops
+// that usually take them.
+bool canFollowJump(DCPUInsn inst, bool guarded) {
+	if(inst.a.val != DCPUValue::VT_LITERAL) return false;
+	if(inst.op == DO_JSR) return !guarded;
+	if(inst.op != DO_SET || inst.b.val != DCPUValue::VT_PC) return false;
+	return !guarded || inst.a.nextWord <= inst.offset;
+}
+
+// Where execution carries on after an instruction in a trace
+uint16_t traceNextPC(DCPUInsn inst, bool followed) {
+	return followed ? inst.a.nextWord : inst.nextOffset;
+}
+
+// Decode the trace starting at the current PC into insns. Jumps accepted by
+// canFollowJump are followed to their targets, as long as those haven't been
+// decoded into the trace already, and are marked in followed. PC is left
+// unchanged.
+void decodeTrace(DCPUState& st, std::vector<DCPUInsn>& insns, std::vector<bool>& followed) {
+	uint16_t savedPC = st.info.pc;
+	std::set<uint16_t> visited;
+	bool guarded = false;
+	while(true) {
+		DCPUInsn inst = st.decodeInsn();
+		visited.insert(inst.offset);
+		insns.push_back(inst);
+		followed.push_back(false);
+		if(isConditionalInsn(inst)) {
+			guarded = true;
+			continue;
+		}
+		if(insns.size() < JIT_MAX_BLOCK_INSNS && canFollowJump(inst, guarded) &&
+				visited.count(inst.a.nextWord) == 0) {
+			followed.back() = true;
+			st.info.pc = inst.a.nextWord;
+		} else if(!guarded && endsBlock(inst)) {
 			break;
-		case DO_IFC:
-			s.jz(localDontSkip);
+		}
+		if(!guarded && insns.size() >= JIT_MAX_BLOCK_INSNS)
 			break;
-		case DO_IFE:
-			s.je(localDontSkip);
+		guarded = false;
+	}
+	st.info.pc = savedPC;
+}
+
+// Count the accesses an operand makes to each guest register
+void countSlotUses(DCPUValue v, uint32_t* uses) {
+	switch(v.val) {
+		case DCPUValue::VT_REGISTER:
+		case DCPUValue::VT_INDIRECT_REGISTER:
+		case DCPUValue::VT_INDIRECT_REGISTER_OFFSET:
+			uses[v.reg]++;
 			break;
-		case DO_IFN:
-			s.jne(localDontSkip);
+		case DCPUValue::VT_PUSHPOP:
+		case DCPUValue::VT_PEEK:
+		case DCPUValue::VT_PICK:
+		case DCPUValue::VT_SP:
+			uses[SLOT_SP]++;
 			break;
-		case DO_IFG: // Unsigned
-			s.ja(localDontSkip);
+		case DCPUValue::VT_EX:
+			uses[SLOT_EX]++;
 			break;
-		case DO_IFA: // Signed
-			s.jg(localDontSkip);
+		default:
 			break;
-		case DO_IFL: // Unsigned
-			s.jb(localDontSkip);
+	}
+}
+
+// Mark the guest register an operand stores to, if any
+void markSlotWrite(DCPUValue v, bool* written) {
+	switch(v.val) {
+		case DCPUValue::VT_REGISTER:
+			written[v.reg] = true;
+			break;
+		case DCPUValue::VT_SP:
+			written[SLOT_SP] = true;
 			break;
-		case DO_IFU: // Signed
-			s.jl(localDontSkip);
+		case DCPUValue::VT_EX:
+			written[SLOT_EX] = true;
 			break;
 		default:
 			break;
 	}
-	emitCostCycles(s, skipCost);
-	s.jmp(cgs.condEndLbl);
-	s.bind(localDontSkip);
 }
 
-bool isConditionalInsn(DCPUInsn inst) {
-	switch(inst.op) {
-		case DO_IFB:
-		case DO_IFC:
-		case DO_IFE:
-		case DO_IFN:
-		case DO_IFG:
-		case DO_IFA:
-		case DO_IFL:
-		case DO_IFU:
-			return true;
-		default:
-			return false;
+// Find the guest registers the block writes, and give the most used ones
+// host registers for the whole block. A register needs at least two uses to
+// be worth loading and storing back. Dead instructions aren't emitted, so
+// they're left out.
+void allocateRegisters(CodeGenState& cgs, const JITIRBlock& block) {
+	uint32_t uses[NUM_SLOTS];
+	memset(uses, 0, sizeof(uses));
+	memset(cgs.written, 0, sizeof(cgs.written));
+	for(size_t n=0;n < block.size();n++) {
+		if(block[n].flags & JIT_IR_DEAD) continue;
+		DCPUInsn inst = block[n].insn;
+		if((block[n].flags & (JIT_IR_SETS_EX | JIT_IR_EX_DEAD)) == JIT_IR_SETS_EX) {
+			uses[SLOT_EX]++;
+			cgs.written[SLOT_EX] = true;
+		}
+		countSlotUses(inst.a, uses);
+		if(inst.a.val == DCPUValue::VT_PUSHPOP)
+			cgs.written[SLOT_SP] = true;
+		if(hasBValue(inst)) {
+			countSlotUses(inst.b, uses);
+			if(inst.b.val == DCPUValue::VT_PUSHPOP)
+				cgs.written[SLOT_SP] = true;
+			if(!isConditionalInsn(inst))
+				markSlotWrite(inst.b, cgs.written);
+		}
+		switch(inst.op) {
+			case DO_ADD:
+			case DO_SUB:
+			case DO_MUL:
+			case DO_MLI:
+			case DO_DIV:
+			case DO_DVI:
+			case DO_SHR:
+			case DO_ASR:
+			case DO_SHL:
+			case DO_ADX:
+			case DO_SBX:
+				if(block[n].flags & JIT_IR_EX_DEAD) break;
+				uses[SLOT_EX]++;
+				cgs.written[SLOT_EX] = true;
+				break;
+			case DO_STI:
+			case DO_STD:
+				uses[DCPUValue::I] += 2;
+				uses[DCPUValue::J] += 2;
+				cgs.written[DCPUValue::I] = true;
+				cgs.written[DCPUValue::J] = true;
+				break;
+			case DO_JSR:
+				uses[SLOT_SP]++;
+				cgs.written[SLOT_SP] = true;
+				break;
+			case DO_RFI:
+				uses[SLOT_SP] += 2;
+				uses[DCPUValue::A]++;
+				cgs.written[SLOT_SP] = true;
+				cgs.written[DCPUValue::A] = true;
+				break;
+			case DO_HWN:
+			case DO_IAG:
+				markSlotWrite(inst.a, cgs.written);
+				break;
+			default:
+				break;
+		}
+	}
+
+	// PC and IA are only touched at block boundaries or by rare
+	// instructions, so they always stay in memory
+	uses[SLOT_PC] = 0;
+	uses[SLOT_IA] = 0;
+	for(int i=0;i < NUM_SLOTS;i++)
+		cgs.hostReg[i] = -1;
+	for(size_t r=0;r < HOST_REGISTER_POOL_SIZE;r++) {
+		int best = -1;
+		for(int i=0;i < NUM_SLOTS;i++) {
+			if(cgs.hostReg[i] >= 0 || uses[i] < 2) continue;
+			if(best == -1 || uses[i] > uses[best]) best = i;
+		}
+		if(best == -1) break;
+		cgs.hostReg[best] = hostRegisterPool[r];
 	}
 }
 
-// Called from the main generation loop whenever an IF* opcode is encountered. This
-// function figures out the length of the conditional chain, figures out the cycle
-// cost for each function to skip, sets up the code generation state's bindCtr member
-// to let the caller know when to bind to the skip target, emits the assembly
-// for all the conditionals in the chain, and finally sets up the program counter of
-// the DCPUState to the instruction after the last IF in the chain.
-void handleConditionalGeneration(Assembler& s, CodeGenState& cgs, DCPUState& st) {
-	uint16_t savedPC = st.info.pc;
+// Emitted before each instruction. When cycles are charged per instruction,
+// poll for interrupts, then charge for the instruction. In profile mode,
+// count it.
+void emitInsnPrologue(Assembler& s, CodeGenState& cgs, DCPUInsn inst) {
+	if(cgs.cycleMode == JIT_CYCLES_PER_INSN) {
+		emitCycleHook(s, cgs, inst.offset);
+		emitCostCycles(s, inst.cycleCost);
+	}
+	if(cgs.profile)
+		emitTracepoint(s, inst.offset, 1, inst.cycleCost);
+}
 
+// Called from the main generation loop whenever an IF* opcode is encountered. This
+// function figures out the length of the conditional chain starting at block[n],
+// figures out the cycle cost for each function to skip, sets up the code generation
+// state's bindCtr member to let the caller know when to bind to the skip target,
+// emits the assembly for all the conditionals in the chain, and finally returns the
+// index of the last IF in the chain.
+size_t handleConditionalGeneration(Assembler& s, CodeGenState& cgs, const JITIRBlock& block, size_t n) {
 	// Skip forward and find the end of the conditional block
 	// Keep track of the cycle cost of the first test failing
-	uint32_t numSkipped = 0;
-	while(isConditionalInsn(st.decodeInsn())) numSkipped++;
+	size_t last = n;
+	while(last+1 < block.size() && isConditionalInsn(block[last+1].insn)) last++;
+	uint32_t numSkipped = last - n + 1;
 
 	// Set up code emission state
 	cgs.condEndLbl = s.newLabel();
 
-	// Reset PC and start emitting code
-	st.info.pc = savedPC;
-	DCPUInsn inst;
-	while(isConditionalInsn(inst = st.decodeInsn())) {
-		savedPC = st.info.pc;
+	// When the whole block was charged on entry, a failed test also has to
+	// give back what the rest of the chain and the body were charged
+	int32_t precharged = 0;
+	if(cgs.cycleMode == JIT_CYCLES_PER_BLOCK) {
+		for(size_t i=n;i <= last+1 && i < block.size();i++)
+			precharged += block[i].insn.cycleCost;
+	}
+
+	for(size_t i=n;i <= last;i++) {
+		if(i != n)
+			emitInsnPrologue(s, cgs, block[i].insn);
+		if(cgs.cycleMode == JIT_CYCLES_PER_BLOCK)
+			precharged -= block[i].insn.cycleCost;
+
 		// Here, numSkipped determines the cycles that failing the test
 		// and jumping costs. Since the first conditional will cost the
 		// most, we just decrement the cost for each one, and the cost when
 		// we reach the last conditional in the line will be 1.
-		emitConditional(s, inst, cgs, numSkipped--);
+		emitConditional(s, block[i].insn, cgs, (int32_t)numSkipped - precharged, numSkipped);
+		numSkipped--;
 	}
-	
-	// Restore PC to first non-conditional instruction and set up parameters
-	st.info.pc = savedPC;
 	cgs.bindCtr = 1;
+	return last;
+}
+
+// True if block[n] is a lone test whose body emitConditionalSelect can
+// handle: a SET, ADD, or SUB to a general register, with no stack operands
+// and no reads of PC, that the trace doesn't jump through
+bool isSelectable(const JITIRBlock& block, size_t n) {
+	if(n+1 >= block.size()) return false;
+	const DCPUInsn& test = block[n].insn;
+	const JITIRInsn& body = block[n+1];
+	if(test.a.val == DCPUValue::VT_PUSHPOP || test.b.val == DCPUValue::VT_PUSHPOP)
+		return false;
+	if(body.followed || (body.flags & (JIT_IR_DEAD | JIT_IR_SETS_EX)))
+		return false;
+	switch(body.insn.op) {
+		case DO_SET:
+		case DO_ADD:
+		case DO_SUB:
+			break;
+		default:
+			return false;
+	}
+	return body.insn.b.val == DCPUValue::VT_REGISTER &&
+		body.insn.a.val != DCPUValue::VT_PUSHPOP &&
+		body.insn.a.val != DCPUValue::VT_PC;
+}
+
+// Record each run of consecutive instructions in a trace as one range
+void recordTraceRanges(const std::vector<DCPUInsn>& insns, JITBlockInfo& info) {
+	JITCodeRange range;
+	range.start = insns[0].offset;
+	range.length = 0;
+	for(size_t n=0;n < insns.size();n++) {
+		if(insns[n].offset != (uint16_t)(range.start + range.length)) {
+			info.ranges.push_back(range);
+			range.start = insns[n].offset;
+			range.length = 0;
+		}
+		range.length += (uint16_t)(insns[n].nextOffset - insns[n].offset);
+	}
+	info.ranges.push_back(range);
+}
+
+static void assembleTrace(const JITOptions& options, bool memoryMirrored,
+		const std::vector<DCPUInsn>& insns, const std::vector<bool>& followed,
+		const JITTraceProfile* profile, JITCachedBlock& compiled);
+
+// Find a jump back to the start of the trace that's only reached through
+// tests, so nothing changes from one time round the loop to the next until
+// an interrupt handler runs. Jumps out of the loop can be skipped on the way,
+// if each is guarded by a single test, since there's then only one way round.
+// Returns the cycles each time round costs and sets backEdge to the jump, or
+// returns 0 if the trace isn't such a loop.
+static uint32_t idleLoopCost(const std::vector<DCPUInsn>& insns, const std::vector<bool>& followed,
+		size_t& backEdge) {
+	uint16_t start = insns[0].offset;
+	uint32_t cost = 0;
+	size_t n = 0;
+	while(n < insns.size()) {
+		// Tests only read, unless they pop or push
+		size_t first = n;
+		for(;n < insns.size() && isConditionalInsn(insns[n]);n++) {
+			if(insns[n].a.val == DCPUValue::VT_PUSHPOP ||
+					insns[n].b.val == DCPUValue::VT_PUSHPOP)
+				return 0;
+		}
+		if(n == insns.size()) return 0;
+		const DCPUInsn& inst = insns[n];
+		if(followed[n] || inst.op != DO_SET || inst.b.val != DCPUValue::VT_PC ||
+				inst.a.val != DCPUValue::VT_LITERAL)
+			return 0;
+
+		// Every test in front of the jump back passes
+		if(inst.a.nextWord == start) {
+			for(size_t i=first;i <= n;i++)
+				cost += insns[i].cycleCost;
+			backEdge = n;
+			return cost;
+		}
+
+		// A jump out fails its test, and is skipped for a cycle
+		if(n - first != 1) return 0;
+		cost += insns[first].cycleCost + 1;
+		n++;
+	}
+	return 0;
+}
+
+static bool isIndirect(const DCPUValue& v) {
+	return v.val == DCPUValue::VT_INDIRECT_REGISTER;
+}
+
+static bool isRegister(const DCPUValue& v, int reg) {
+	return v.val == DCPUValue::VT_REGISTER && v.reg == reg;
+}
+
+static bool isLiteral(const DCPUValue& v, uint16_t value) {
+	return v.val == DCPUValue::VT_LITERAL && v.nextWord == value;
+}
+
+// Recognize a loop at the start of the trace that copies or fills memory a
+// word at a time:
+//	STI [J], [I]		STI [I], 0		SET [I], 0
+//	IFN I, end		IFN I, end		ADD I, 1
+//	SET PC, start		SET PC, start		IFN I, end
+//						SET PC, start
+// with STD or SUB for loops that go down, and a register in place of the
+// literal for fills. Returns the packed JITLoopIdiom and sets backEdge to the
+// jump, or returns 0 if the trace isn't such a loop.
+static uint64_t loopIdiom(const std::vector<DCPUInsn>& insns, const std::vector<bool>& followed,
+		size_t& backEdge) {
+	if(insns.size() < 3) return 0;
+	JITLoopIdiom loop;
+	const DCPUInsn& store = insns[0];
+	int dst;
+	size_t test;
+	if(store.op == DO_STI || store.op == DO_STD) {
+		if(!isIndirect(store.b)) return 0;
+		dst = store.b.reg;
+		if(dst != DCPUValue::I && dst != DCPUValue::J) return 0;
+		loop.kind = 0x80;
+		loop.step = (store.op == DO_STI) ? 1 : -1;
+		test = 1;
+	} else if(store.op == DO_SET && isIndirect(store.b) && insns.size() >= 4) {
+		dst = store.b.reg;
+		const DCPUInsn& step = insns[1];
+		if((step.op != DO_ADD && step.op != DO_SUB) || !isRegister(step.b, dst) ||
+				!isLiteral(step.a, 1))
+			return 0;
+		loop.kind = 0;
+		loop.step = (step.op == DO_ADD) ? 1 : -1;
+		test = 2;
+	} else {
+		return 0;
+	}
+
+	// What's stored can't change as the loop goes round
+	bool stepped[8] = {false};
+	stepped[dst] = true;
+	if(loop.stepsIJ())
+		stepped[DCPUValue::I] = stepped[DCPUValue::J] = true;
+	if(store.a.val == DCPUValue::VT_LITERAL) {
+		loop.kind |= JIT_LOOP_FILL;
+		loop.value = store.a.nextWord;
+	} else if(store.a.val == DCPUValue::VT_REGISTER && !stepped[store.a.reg]) {
+		loop.kind |= JIT_LOOP_FILL_REG;
+		loop.value = store.a.reg;
+	} else if(loop.stepsIJ() && isIndirect(store.a) && store.a.reg != dst &&
+			stepped[store.a.reg]) {
+		loop.kind |= JIT_LOOP_COPY;
+		loop.value = store.a.reg;
+	} else {
+		return 0;
+	}
+
+	// The counter is a stepped register, tested against a literal
+	const DCPUInsn& cond = insns[test];
+	const DCPUInsn& jump = insns[test+1];
+	if(cond.op != DO_IFN || cond.b.val != DCPUValue::VT_REGISTER ||
+			!stepped[cond.b.reg] || cond.a.val != DCPUValue::VT_LITERAL)
+		return 0;
+	if(followed[test+1] || jump.op != DO_SET || jump.b.val != DCPUValue::VT_PC ||
+			!isLiteral(jump.a, store.offset))
+		return 0;
+	loop.end = cond.a.nextWord;
+	loop.regs = dst | (cond.b.reg << 4);
+
+	uint32_t cost = 0;
+	for(size_t n=0;n <= test+1;n++)
+		cost += insns[n].cycleCost;
+	if(cost > 0xff) return 0;
+	loop.cost = cost;
+
+	backEdge = test+1;
+	uint64_t packed;
+	memcpy(&packed, &loop, sizeof(packed));
+	return packed;
 }
 
 void JITProcessor::generateCode() {
-	// Save the CPU's program counter
-	uint32_t oldPC = m_state.info.pc;
+	uint16_t oldPC = m_state.info.pc;
+
+	// Decode the whole trace first, and optimize it as a unit before
+	// register allocation looks at it
+	std::vector<DCPUInsn> insns;
+	std::vector<bool> followed;
+	decodeTrace(m_state, insns, followed);
+
+	// Record the words the trace was decoded from so writes to them can
+	// invalidate it. They're also what a saved translation has to match.
+	JITBlockInfo blockInfo;
+	recordTraceRanges(insns, blockInfo);
+	if(loadSavedBlock(oldPC, blockInfo))
+		return;
+
+	JITCachedBlock compiled;
+	compiled.pc = oldPC;
+	compiled.ranges = blockInfo.ranges;
+	assembleTrace(m_options, m_state.memoryMirrored, insns, followed, NULL, compiled);
+	if(installBlock(compiled))
+		saveBlock(compiled);
+}
 
-	// Create storage for the emitted instructions
+// Generate the code for a decoded trace starting at compiled.pc. profile is
+// what the block's first translation recorded when it's being recompiled, or
+// NULL. Nothing but the arguments is touched, so this can run on any thread.
+static void assembleTrace(const JITOptions& options, bool memoryMirrored,
+		const std::vector<DCPUInsn>& insns, const std::vector<bool>& followed,
+		const JITTraceProfile* profile, JITCachedBlock& compiled) {
+	uint16_t oldPC = compiled.pc;
+	JITIRBlock block;
+	jitBuildIR(insns, followed, block);
+	jitOptimizeIR(block, options.cycleMode == JIT_CYCLES_PER_INSN);
+
+	// Create storage for the emitted instructions. It's copied out, never
+	// made into a function.
 	AsmJit::Assembler buf;
 	CodeGenState state;
 	state.bindCtr = -1;
-	
-	// Compile until we hit the next jump instruction
-	DCPUInsn inst;
+	state.cycleMode = options.cycleMode;
+	state.refund = 0;
+	state.exDead = false;
+	state.memoryMirrored = memoryMirrored;
+	state.profile = options.profile;
+	state.idleCost = 0;
+	state.loopIdiom = 0;
+	state.countTests = (options.hotThreshold != 0 && profile == NULL);
+	state.traceProfile = profile;
+	allocateRegisters(state, block);
+
+	// Loops that only wait for an interrupt are skipped over. Charging
+	// per instruction leaves them where the budget runs out, so they're
+	// only recognized when blocks are charged on entry. So are copy and
+	// fill loops, and neither is when profiling, which counts every time
+	// round.
+	size_t idleBackEdge = insns.size();
+	uint32_t idleCost = 0;
+	size_t idiomBackEdge = insns.size();
+	uint64_t idiom = 0;
+	if(options.cycleMode == JIT_CYCLES_PER_BLOCK && !options.profile) {
+		idleCost = idleLoopCost(insns, followed, idleBackEdge);
+		idiom = loopIdiom(insns, followed, idiomBackEdge);
+	}
+
+	// Static cost of running every instruction in the block
 	uint32_t cost = 0;
-	bool assembling = true;
+	for(size_t n=0;n < insns.size();n++)
+		cost += insns[n].cycleCost;
+	compiled.chunkCost = (cost == 0) ? 1 : cost;
+	
+	// In per-block mode, interrupts are only polled for on entry, and the
+	// whole block is charged up front. Exits before the end and failed IF
+	// tests correct the charge, so the cycle count stays exact.
 	emitHeader(buf);
-	while(assembling) {
+
+	// Blocks that will be recompiled count down to it on every entry,
+	// before anything is loaded or charged
+	Label hot = buf.newLabel();
+	if(state.countTests) {
+		emitTableLoad(buf, rax, JIT_TABLE_BLOCK_COUNTS);
+		buf.sub(dword_ptr(rax, sizeof(uint32_t)*oldPC), 1);
+		buf.jz(hot);
+	}
+	emitReload(buf, state);
+	if(options.cycleMode == JIT_CYCLES_PER_BLOCK) {
+		emitCycleHook(buf, state, oldPC);
+		emitCostCycles(buf, compiled.chunkCost);
+		state.refund = cost;
+	}
+
+	// Compile until we hit the next jump instruction
+	for(size_t n=0;n < block.size();n++) {
 #ifdef ASSEMBLY_ERROR_CHECKING
 		if(buf.getError() != 0) {
-			printf("Assembly error: %s at %04x\n", getErrorString(buf.getError()), m_state.info.pc);
+			printf("Assembly error: %s at %04x\n", getErrorString(buf.getError()), block[n].insn.offset);
 			break;
 		}
 #endif
-		inst = m_state.decodeInsn();
-		cost += inst.cycleCost;
+		DCPUInsn inst = block[n].insn;
+		if(options.cycleMode == JIT_CYCLES_PER_BLOCK)
+			state.refund -= inst.cycleCost;
 		if(state.bindCtr == 0) {
 			state.bindCtr = -1;
 			buf.bind(state.condEndLbl);
 		} else if(state.bindCtr > 0) {
 			state.bindCtr--;
 		}
-		// Check for external opcodes
-		switch(inst.op) {
-			// Hardware interaction is done externally for now. Just set eax to 1 and
-			// return.
-			case DO_HWI:
-			case DO_HWQ:
-			case DO_HWN:
-				buf.mov(eax, 1);
-				buf.ret();
-				assembling = false;
-				continue;
-			default:
-				break;
+
+		// Dead instructions are only charged for, which already happened
+		// on block entry
+		if(block[n].flags & JIT_IR_DEAD) {
+			if(state.profile)
+				emitTracepoint(buf, inst.offset, 1, inst.cycleCost);
+			continue;
+		}
+		state.exDead = (block[n].flags & JIT_IR_EX_DEAD) != 0;
+
+		// Jumps the trace continues through only leave something to do
+		// for JSR, and when they can be skipped, a side exit for the
+		// skip path
+		if(block[n].followed) {
+			emitInsnPrologue(buf, state, inst);
+			if(inst.op == DO_JSR) {
+				emitReturnPush(buf, inst, state);
+				emitShadowPush(buf, inst, state);
+				emitCodeInvalidationCheck(buf, state, inst.a.nextWord);
+			}
+			if(state.bindCtr == 0) {
+				Label taken = buf.newLabel();
+				buf.jmp(taken);
+				buf.bind(state.condEndLbl);
+				state.bindCtr = -1;
+				emitDCPUSetPC(buf, inst.nextOffset);
+				emitChainExit(buf, state);
+				buf.bind(taken);
+			}
+			continue;
 		}
-		
+
 		// The only time we need to adjust PC is when we encounter an insn
-		// that depends on it, since our code will always run as a block. This
-		// will always hit on the last instruction since we stop assembling
-		// when PC is changed.
-		if(inst.a.val == DCPUValue::VT_PC || inst.b.val == DCPUValue::VT_PC) {
-			emitDCPUSetPC(buf, inst.offset);
+		// that depends on it, since our code will always run as a block.
+		// Reads of PC see the address of the next instruction.
+		if(inst.a.val == DCPUValue::VT_PC ||
+				(hasBValue(inst) && inst.b.val == DCPUValue::VT_PC)) {
+			emitDCPUSetPC(buf, inst.nextOffset);
+		}
+		emitInsnPrologue(buf, state, inst);
+		if(isConditionalInsn(inst) && options.cycleMode == JIT_CYCLES_PER_BLOCK &&
+				!state.countTests && !state.profile &&
+				!testPredictable(state, inst.offset) && isSelectable(block, n)) {
+			// The body is emitted along with the test. Failing
+			// skips it at a cycle, and it was already charged for.
+			// Tests a profile shows going one way nearly every time
+			// are left to the branch predictor, and ones still being
+			// counted, or profiled, are left as branches to count.
+			DCPUInsn body = block[n+1].insn;
+			state.exDead = (block[n+1].flags & JIT_IR_EX_DEAD) != 0;
+			state.refund -= body.cycleCost;
+			emitConditionalSelect(buf, inst, body, state, 1 - (int32_t)body.cycleCost);
+			n++;
+			continue;
 		}
-		emitCostCycles(buf, inst.cycleCost);
-		emitCycleHook(buf, inst.cycleCost);
 		if(isConditionalInsn(inst)) {
-			m_state.info.pc = inst.offset;
-			handleConditionalGeneration(buf, state, m_state);
+			// The rest of the chain is emitted along with it
+			size_t last = handleConditionalGeneration(buf, state, block, n);
+			for(size_t i=n+1;i <= last;i++) {
+				if(options.cycleMode == JIT_CYCLES_PER_BLOCK)
+					state.refund -= block[i].insn.cycleCost;
+			}
+			n = last;
 			continue;
 		}
 		switch(inst.op) {
 			case DO_SET:
 				emitSET(buf, inst, state);
-				if(inst.b.val == DCPUValue::VT_PC) {
-					if(state.bindCtr == -1) {
-						// For jump instructions, just set PC and
-						// return
-						assembling = false;
-					} else {
-						// Make sure that the skipped instruction still emits a ret
-						emitFooter(buf);
-					}
-				}
+				if(block[n].flags & JIT_IR_SETS_EX)
+					emitOverflowStore(buf, state, block[n].exValue);
 				break;
 			case DO_ADD:
 				emitADD(buf, inst, state);
@@ -1119,25 +2779,9 @@ void JITProcessor::generateCode() {
 				break;
 			case DO_STI:
 				emitSTI(buf, inst, state);
-				if(inst.b.val == DCPUValue::VT_PC) {
-					if(state.bindCtr == -1) {
-						assembling = false;
-					} else {
-						// Make sure that the skipped instruction still emits a ret
-						emitFooter(buf);
-					}
-				}
 				break;
 			case DO_STD:
 				emitSTD(buf, inst, state);
-				if(inst.b.val == DCPUValue::VT_PC) {
-					if(state.bindCtr == -1) {
-						assembling = false;
-					} else {
-						// Make sure that the skipped instruction still emits a ret
-						emitFooter(buf);
-					}
-				}
 				break;
 			case DO_ADX:
 				emitADX(buf, inst, state);
@@ -1153,10 +2797,6 @@ void JITProcessor::generateCode() {
 				break;
 			case DO_JSR:
 				emitJSR(buf, inst, state);
-				if(state.bindCtr == -1)
-					assembling = false;
-				else
-					emitFooter(buf);
 				break;
 			case DO_IAS:
 				emitIAS(buf, inst, state);
@@ -1171,32 +2811,356 @@ void JITProcessor::generateCode() {
 				emitHWN(buf, inst, state);
 				break;
 			case DO_HWI:
+				// Leaves the block by itself
 				emitHWI(buf, inst, state);
 				break;
 			case DO_HWQ:
 				emitHWQ(buf, inst, state);
 				break;
 			default:
-				assembling = false;
+				// Invalid instructions stop the block, which then
+				// starts over
 				break;
 		}
+
+		if(insnWritesPC(inst)) {
+			// Jumps always leave the block, even when they can be
+			// skipped
+			switch(inst.op) {
+				case DO_SET:
+				case DO_STI:
+				case DO_STD:
+				case DO_JSR:
+					state.idleCost = (n == idleBackEdge) ? idleCost : 0;
+					state.loopIdiom = (n == idiomBackEdge) ? idiom : 0;
+					emitJumpExit(buf, state, inst);
+					state.idleCost = 0;
+					state.loopIdiom = 0;
+					break;
+				default:
+					emitBlockExit(buf, state);
+					break;
+			}
+		} else if(inst.op != DO_HWI && insnWritesMemory(inst)) {
+			emitCodeInvalidationCheck(buf, state, inst.nextOffset);
+		}
 	}
 	if(state.bindCtr >= 0) {
 		buf.bind(state.condEndLbl);
 	}
-	emitFooter(buf);
-	
-	// Store the function in cache and restore the program counter
-	m_codeCache[oldPC] = function_cast<dcpu64Func>(buf.make());
+
+	// Traces cut off at the length limit continue with the next
+	// instruction or jump target, and ones ending on an invalid instruction
+	// start over
+	const DCPUInsn& last = insns.back();
+	if(last.op == DO_INVALID) {
+		emitDCPUSetPC(buf, oldPC);
+		emitBlockExit(buf, state);
+	} else if(followed.back() || !endsBlock(last)) {
+		emitDCPUSetPC(buf, traceNextPC(last, followed.back()));
+		emitChainExit(buf, state);
+	}
+
+	// Back to cycle() to be recompiled, with PC still at the start
+	if(state.countTests) {
+		buf.bind(hot);
+		buf.mov(byte_ptr(rdi, 0x48), 1);
+		emitFooter(buf);
+	}
+	emitColdSkips(buf, state);
+	emitBranchCaches(buf, state);
+
+	// Copy out the code and the offsets of everything that gets patched
+	compiled.code.resize(buf.getCodeSize());
+	buf.relocCode(&compiled.code[0]);
 #ifdef ASSEMBLY_ERROR_CHECKING
-	if(m_codeCache[oldPC] == NULL) {
+	if(buf.getError() != 0) {
 		printf("Assembly error - Program will crash. E: %s\n", getErrorString(buf.getError()));
 		fflush(stdout);
 	}
 #endif
-	m_chunkCosts[oldPC] = (cost == 0) ? 1 : cost;
-	m_cacheAddrs.push_back(oldPC);
-	m_state.info.pc = oldPC;
+	compiled.exits.assign(state.chainSites.begin(), state.chainSites.end());
+	compiled.branchCaches.assign(state.branchCacheOffsets.begin(), state.branchCacheOffsets.end());
+}
+
+// Copy compiled code into the arena and make it the block at its pc, making
+// room for it first if the arena is full. Nothing generated is running while
+// this happens, so everything can go.
+bool JITProcessor::installBlock(const JITCachedBlock& compiled) {
+	// Saved before a flush can drop what the ranges came from
+	JITBlockInfo info;
+	info.ranges = compiled.ranges;
+	if(!m_arena.fits(compiled.code.size()))
+		flushCodeCache();
+	uint8_t* code = m_arena.allocate(compiled.code.size());
+	if(code == NULL) return false;
+	memcpy(code, &compiled.code[0], compiled.code.size());
+
+	m_codeCache[compiled.pc] = (dcpu64Func)code;
+	m_chunkCosts[compiled.pc] = compiled.chunkCost;
+	m_blockCounts[compiled.pc] = m_options.hotThreshold;
+	for(size_t e=0;e < compiled.exits.size();e++)
+		info.exits.push_back(code + compiled.exits[e]);
+	for(size_t c=0;c < compiled.branchCaches.size();c++)
+		info.branchCaches.push_back((JITBranchCache*)(code + compiled.branchCaches[c]));
+	registerBlock(compiled.pc, info);
+	return true;
+}
+
+static void gatherRangeWords(const std::vector<JITCodeRange>& ranges, const uint16_t* memory,
+		std::vector<uint16_t>& words) {
+	for(size_t r=0;r < ranges.size();r++) {
+		for(uint32_t i=0;i < ranges[r].length;i++)
+			words.push_back(memory[(uint16_t)(ranges[r].start + i)]);
+	}
+}
+
+void JITProcessor::compilerMain() {
+	JITCompileJob* job;
+	while(true) {
+		while(m_compileRequests.pop(job)) {
+			assembleTrace(m_options, m_state.memoryMirrored, job->insns,
+					job->followed, job->recompile ? &job->profile : NULL,
+					job->compiled);
+			// There's always room, since no more jobs are in flight than
+			// either queue holds
+			m_compileResults.push(job);
+		}
+		boost::unique_lock<boost::mutex> lock(m_compileLock);
+		while(m_compileRequests.read_available() == 0 && !m_compilerStop)
+			m_compileWake.wait(lock);
+		if(m_compilerStop) return;
+	}
+}
+
+// Queue the block at pc for the background compiler, or with a profile, to
+// be compiled again. Returns false if the queue is full, in which case it's
+// tried again the next time the block runs.
+bool JITProcessor::requestCompile(uint16_t pc, const JITTraceProfile* profile) {
+	if(m_compilesInFlight >= JIT_COMPILE_QUEUE_SIZE) return false;
+	JITCompileJob* job = new JITCompileJob();
+	uint16_t savedPC = m_state.info.pc;
+	m_state.info.pc = pc;
+	decodeTrace(m_state, job->insns, job->followed);
+	m_state.info.pc = savedPC;
+
+	JITBlockInfo ranges;
+	recordTraceRanges(job->insns, ranges);
+	job->compiled.pc = pc;
+	job->compiled.ranges = ranges.ranges;
+	gatherRangeWords(ranges.ranges, m_state.info.memory, job->words);
+	job->recompile = (profile != NULL);
+	if(profile != NULL)
+		job->profile = *profile;
+
+	m_compileRequests.push(job);
+	m_compilesInFlight++;
+	m_compilePending[pc] = true;
+	// Taking the lock orders the push before the compiler's check that the
+	// queue is empty, so the wakeup can't be missed
+	{
+		boost::lock_guard<boost::mutex> lock(m_compileLock);
+	}
+	m_compileWake.notify_one();
+	return true;
+}
+
+// Install whatever the background compiler has finished. Code for blocks
+// that have been overwritten since they were queued is thrown away.
+void JITProcessor::installCompiled() {
+	JITCompileJob* job;
+	while(m_compileResults.pop(job)) {
+		uint16_t pc = job->compiled.pc;
+		m_compilesInFlight--;
+		m_compilePending[pc] = false;
+
+		std::vector<uint16_t> words;
+		gatherRangeWords(job->compiled.ranges, m_state.info.memory, words);
+		if(words != job->words) {
+			delete job;
+			continue;
+		}
+		if(job->recompile) {
+			// Only while the first translation is still there to
+			// replace
+			if(m_codeCache[pc] != NULL) {
+				invalidateBlock(pc);
+				if(installBlock(job->compiled))
+					m_promotions++;
+			}
+		} else if(m_codeCache[pc] == NULL) {
+			invalidateBlock(pc);
+			if(installBlock(job->compiled))
+				saveBlock(job->compiled);
+		}
+		delete job;
+	}
+}
+
+// Compile the block at pc again, now that it's run enough to show how its
+// tests and indirect jumps go. The new code takes the old code's place the
+// way an invalidation would, all at once between blocks, and doesn't count
+// anything. It isn't saved, since the profile isn't part of the key.
+void JITProcessor::promoteBlock(uint16_t pc) {
+	std::map<uint16_t, JITBlockInfo>::iterator blk = m_blocks.find(pc);
+	if(m_codeCache[pc] == NULL || blk == m_blocks.end() || m_compilePending[pc])
+		return;
+	JITTraceProfile profile;
+	gatherProfile(blk->second, profile);
+
+	// With a background compiler, the old code keeps running until the
+	// new code is ready. If the queue is full, the count starts over.
+	if(m_compiler != NULL) {
+		if(!requestCompile(pc, &profile))
+			m_blockCounts[pc] = m_options.hotThreshold;
+		return;
+	}
+
+	std::vector<DCPUInsn> insns;
+	std::vector<bool> followed;
+	uint16_t savedPC = m_state.info.pc;
+	m_state.info.pc = pc;
+	decodeTrace(m_state, insns, followed);
+	m_state.info.pc = savedPC;
+
+	JITCachedBlock compiled;
+	compiled.pc = pc;
+	compiled.ranges = blk->second.ranges;
+	assembleTrace(m_options, m_state.memoryMirrored, insns, followed, &profile, compiled);
+	invalidateBlock(pc);
+	if(installBlock(compiled))
+		m_promotions++;
+}
+
+// Collect what a block's code counted: the outcomes of the tests at every
+// address it was decoded from, and the newest target in each of its indirect
+// jump caches
+void JITProcessor::gatherProfile(const JITBlockInfo& info, JITTraceProfile& profile) {
+	for(size_t r=0;r < info.ranges.size();r++) {
+		for(uint32_t i=0;i < info.ranges[r].length;i++) {
+			uint16_t addr = info.ranges[r].start + i;
+			const JITTestCounts& counts = m_testCounts[addr];
+			if(counts.passed != 0 || counts.failed != 0)
+				profile.tests[addr] = counts;
+		}
+	}
+	for(size_t c=0;c < info.branchCaches.size();c++) {
+		const JITBranchCache* cache = info.branchCaches[c];
+		if(cache->pc[0] != JIT_RETURN_NONE)
+			profile.jumpTargets[cache->site] = cache->pc[0];
+	}
+}
+
+// Write a newly compiled block to the translation cache directory
+void JITProcessor::saveBlock(const JITCachedBlock& compiled) {
+	if(m_options.translationCache.empty()) return;
+	uint64_t key = jitCacheKey(compiled.pc, compiled.ranges, m_state.info.memory, codeSettings());
+	if(jitCacheStore(m_options.translationCache, key, m_state.info.memory, compiled))
+		m_savedStores++;
+}
+
+// Everything besides the guest code that changes what's generated for it
+uint32_t JITProcessor::codeSettings() {
+	return (uint32_t)m_options.cycleMode |
+		(m_options.profile ? 0x100 : 0) |
+		(m_state.memoryMirrored ? 0x200 : 0) |
+		(m_options.hotThreshold != 0 ? 0x400 : 0);
+}
+
+// Load the translation of the block at pc from the translation cache
+// directory, if it holds one made from the same words decoded has ranges for
+bool JITProcessor::loadSavedBlock(uint16_t pc, const JITBlockInfo& decoded) {
+	if(m_options.translationCache.empty()) return false;
+	JITCachedBlock saved;
+	saved.pc = pc;
+	saved.ranges = decoded.ranges;
+	uint64_t key = jitCacheKey(pc, saved.ranges, m_state.info.memory, codeSettings());
+	if(!jitCacheLoad(m_options.translationCache, key, m_state.info.memory, saved) ||
+			!installBlock(saved))
+		return false;
+	m_savedLoads++;
+	return true;
+}
+
+JITBlockInfo& JITProcessor::interpretedBlock(uint16_t pc) {
+	std::map<uint16_t, JITBlockInfo>::iterator blk = m_blocks.find(pc);
+	if(blk != m_blocks.end())
+		return blk->second;
+
+	// The interpreter runs the same traces the compiler would build, so
+	// both leave them at the same points
+	JITBlockInfo info;
+	std::vector<bool> followed;
+	uint16_t savedPC = m_state.info.pc;
+	m_state.info.pc = pc;
+	decodeTrace(m_state, info.decoded, followed);
+	m_state.info.pc = savedPC;
+	recordTraceRanges(info.decoded, info);
+	registerBlock(pc, info);
+	return m_blocks[pc];
+}
+
+// Add the addresses a trace can leave to when it's run. Jumps to computed
+// addresses can't be followed, apart from returns to the instruction after a
+// call.
+static void traceSuccessors(const std::vector<DCPUInsn>& insns, const std::vector<bool>& followed,
+		std::vector<uint16_t>& targets) {
+	for(size_t n=0;n < insns.size();n++) {
+		const DCPUInsn& inst = insns[n];
+		bool guarded = (n > 0 && isConditionalInsn(insns[n-1]));
+		// A skipped instruction carries on after itself
+		if(guarded)
+			targets.push_back(inst.nextOffset);
+		if(inst.a.val == DCPUValue::VT_LITERAL) {
+			if(inst.op == DO_JSR || inst.op == DO_IAS ||
+					(inst.op == DO_SET && inst.b.val == DCPUValue::VT_PC))
+				targets.push_back(inst.a.nextWord);
+		}
+		if(inst.op == DO_JSR)
+			targets.push_back(inst.nextOffset);
+	}
+	const DCPUInsn& last = insns.back();
+	if(last.op != DO_INVALID && (followed.back() || !endsBlock(last)))
+		targets.push_back(traceNextPC(last, followed.back()));
+}
+
+uint32_t JITProcessor::precompile(uint16_t entry) {
+	uint16_t savedPC = m_state.info.pc;
+	std::vector<bool> seen(0x10000, false);
+	std::vector<uint16_t> pending(1, entry);
+	seen[entry] = true;
+	uint32_t compiled = 0;
+	while(!pending.empty()) {
+		uint16_t pc = pending.back();
+		pending.pop_back();
+
+		std::vector<DCPUInsn> insns;
+		std::vector<bool> followed;
+		m_state.info.pc = pc;
+		decodeTrace(m_state, insns, followed);
+		if(m_codeCache[pc] == NULL)
+			generateCode();
+		if(m_codeCache[pc] != NULL)
+			compiled++;
+
+		std::vector<uint16_t> targets;
+		traceSuccessors(insns, followed, targets);
+		for(size_t t=0;t < targets.size();t++) {
+			if(seen[targets[t]]) continue;
+			seen[targets[t]] = true;
+			pending.push_back(targets[t]);
+		}
+	}
+	m_state.info.pc = savedPC;
+	return compiled;
+}
+
+bool JITProcessor::idle() const {
+	return m_state.info.idle != 0;
+}
+
+void JITProcessor::skipIdle(uint64_t cycles) {
+	m_state.elapsed += cycles;
 }
 
 DCPUState& JITProcessor::getState() {
@@ -1,29 +1,325 @@
 #pragma once
+#include <stdio.h>
 #include <stdlib.h>
 #include <stdint.h>
 #include <string>
 #include <list>
+#include <map>
+#include <vector>
 #include <sstream>
+#include <boost/thread.hpp>
+#include <boost/lockfree/spsc_queue.hpp>
 #include "dcpu.hpp"
 
 #include "asmjit/AsmJit.h"
 
 typedef void (*dcpu64Func)(DCPURegisterInfo* ri);
 
+// The generated loop that runs compiled blocks one after another. Returns the
+// address of a chainable jump the last block left through, or NULL.
+typedef uint8_t* (*JITDispatchFunc)(DCPURegisterInfo* ri);
+
+// Longest run of instructions compiled into one block, not counting an IF
+// chain at the end. Longer straight-line code is split into blocks that chain
+// into each other.
+#define JIT_MAX_BLOCK_INSNS 256
+
+// A contiguous run of guest words that a translated block was decoded from
+struct JITCodeRange {
+	uint16_t start;
+	uint16_t length;
+};
+
+// A jump at the end of one block that has been patched to go straight into
+// the start of another
+struct JITLink {
+	uint8_t* site;	// Address of the jmp rel32 instruction
+	uint16_t from;	// Start address of the block containing the jump
+	uint16_t to;	// Start address of the block jumped to
+};
+
+// Number of targets remembered by each indirect jump
+#define JIT_BRANCH_CACHE_WAYS 2
+
+// Inline cache for a jump whose target isn't known statically, such as
+// SET PC, A. The generated code compares the new PC with the cached targets
+// and jumps straight to the matching code. On a miss it goes through the
+// shared lookup stub, which fills the cache from m_codeCache. Caches are
+// stored in the code of the block they belong to, after its instructions,
+// and are cleared along with the shadow return stack.
+struct JITBranchCache {
+	uint32_t pc[JIT_BRANCH_CACHE_WAYS];	// Guest targets, or JIT_RETURN_NONE
+	dcpu64Func code[JIT_BRANCH_CACHE_WAYS];	// Translation of each target
+	uint64_t hits;		// Only counted in profile mode
+	uint64_t misses;
+	uint16_t site;		// Address of the jump instruction
+};
+
+// Bookkeeping for a single translated block. Blocks that haven't been compiled
+// yet are run by the interpreter from their decoded instructions.
+struct JITBlockInfo {
+	JITBlockInfo() : executions(0) {}
+
+	std::vector<JITCodeRange> ranges;
+	std::vector<DCPUInsn> decoded;	// Only kept until the block is compiled
+	uint32_t executions;	// Times the block was interpreted
+	std::vector<uint8_t*> exits;	// Patchable exits with a static target
+	std::vector<JITLink> incoming;	// Patched jumps into this block
+	std::vector<JITLink> outgoing;	// Patched jumps out of this block
+	std::vector<JITBranchCache*> branchCaches;	// In the block's code
+};
+
+// Number of entries in the shadow return stack. A power of two; deeper call
+// chains overwrite the oldest entries, whose returns then go through cycle().
+#define JIT_RETURN_STACK_SIZE 32
+
+// Return addresses pushed by compiled JSRs, each with the code that was cached
+// for it at the time. A SET PC, POP that pops the predicted address jumps
+// straight into that code instead of going back to cycle(). Entries are
+// cleared whenever compiled code is retired, so a stored pointer is always
+// live code.
+struct JITReturnEntry {
+	uint32_t pc;		// Guest return address, or JIT_RETURN_NONE
+	uint32_t reserved;
+	dcpu64Func code;	// Translation of pc, or NULL
+};
+#define JIT_RETURN_NONE 0xffffffff
+
+struct JITReturnStack {
+	uint32_t top;		// Index of the newest entry
+	uint32_t reserved;
+	JITReturnEntry entries[JIT_RETURN_STACK_SIZE];
+};
+
+// How the generated code charges guest cycles and polls for interrupts.
+//
+// JIT_CYCLES_PER_INSN charges each instruction as it executes and polls for
+// interrupts before every one of them. It's the default.
+//
+// JIT_CYCLES_PER_BLOCK charges a block's static cost (m_chunkCosts) once on
+// entry, and corrects it on failed IF tests and early exits, so the cycle
+// count is the same as in per-instruction mode. Interrupts are only polled for
+// on block entry, so one raised while a block runs is taken up to one block
+// later than it would be otherwise. That delay is bounded by the static cost
+// of one block: JIT_MAX_BLOCK_INSNS instructions of at most 5 cycles each, plus
+// any IF chain the block ends on and the device cycles of an HWI ending it.
+// Skipping idle loops, running copy and fill loops at once, and compiling IF
+// bodies without branches all depend on it, so they're only done in this mode.
+enum JITCycleMode {
+	JIT_CYCLES_PER_INSN,
+	JIT_CYCLES_PER_BLOCK
+};
+
+// Default number of times a block is interpreted before it's compiled
+#define JIT_DEFAULT_TIER_THRESHOLD 16
+
+// Addresses generated code reaches through DCPURegisterInfo::jitTable, so the
+// code itself holds no absolute addresses and can be saved and reloaded
+enum JITTableEntry {
+	JIT_TABLE_RETURN_STACK,
+	JIT_TABLE_CODE_CACHE,
+	JIT_TABLE_LOOKUP_STUB,
+	JIT_TABLE_CYCLE_HOOK,
+	JIT_TABLE_CODE_WRITE_HOOK,
+	JIT_TABLE_HARDWARE_NUMBER,
+	JIT_TABLE_HARDWARE_QUERY,
+	JIT_TABLE_HARDWARE_INTERRUPT,
+	JIT_TABLE_QUEUE_INTERRUPT,
+	JIT_TABLE_LOOP_IDIOM,
+	JIT_TABLE_BLOCK_COUNTS,
+	JIT_TABLE_TEST_COUNTS,
+	JIT_TABLE_INSN_COUNTS,
+	JIT_TABLE_SIZE
+};
+
+// How often the IF at some address has passed and failed, as counted by
+// blocks that are waiting to be recompiled
+struct JITTestCounts {
+	uint32_t passed;
+	uint32_t failed;
+};
+
+// What a block's first translation saw while it ran, which its second one is
+// laid out around: the outcomes of its tests, and the target each indirect
+// jump took last
+struct JITTraceProfile {
+	std::map<uint16_t, JITTestCounts> tests;	// By address of the IF
+	std::map<uint16_t, uint16_t> jumpTargets;	// By address of the jump
+};
+
+// Default and smallest size of the code arena, in bytes. The smallest size
+// still holds the largest block several times over.
+#define JIT_DEFAULT_CODE_CACHE_SIZE (16 << 20)
+#define JIT_MIN_CODE_CACHE_SIZE (256 << 10)
+
+// Executable memory that a JITProcessor's generated code is bump-allocated
+// from, in a single mapping. Code is never freed piece by piece. When the arena
+// fills up, everything above the floor is flushed at once, and code below it
+// (the lookup stub) survives.
+class JITCodeArena : public AsmJit::CodeGenerator {
+public:
+	JITCodeArena(size_t capacity);
+	virtual ~JITCodeArena();
+
+	// Copy the assembler's code into the arena. Fails if it doesn't fit.
+	virtual uint32_t generate(void** dest, AsmJit::Assembler* assembler);
+
+	bool fits(size_t size) const;
+	uint8_t* allocate(size_t size);	// NULL if it doesn't fit
+	void setFloor();	// Keep everything allocated so far across flushes
+	void flush();		// Drop everything above the floor
+	size_t capacity() const { return m_capacity; }
+	size_t used() const { return m_top; }
+private:
+	uint8_t* m_base;
+	size_t m_capacity;
+	size_t m_top;
+	size_t m_floor;
+};
+
+struct JITCachedBlock;
+struct JITCompileJob;
+
+// Most blocks queued for or waiting to be installed from the background
+// compiler at once
+#define JIT_COMPILE_QUEUE_SIZE 64
+
+// Settings for a JITProcessor
+struct JITOptions {
+	JITOptions();
+
+	JITCycleMode cycleMode;
+	// Number of times a block is run by the interpreter before it's
+	// compiled. Zero compiles every block the first time it's reached.
+	uint32_t tierThreshold;
+	// Count hits and misses of the indirect jump caches, and the runs and
+	// cycles of every instruction. Copy and fill loops and idle loops
+	// are run one time round at a time, so every run is counted.
+	bool profile;
+	// Bytes of generated code kept at once. The whole cache is flushed
+	// when it fills up.
+	size_t codeCacheSize;
+	// Directory translated blocks are saved to and loaded from, so later
+	// runs of the same code don't have to compile them again. Empty for
+	// none.
+	std::string translationCache;
+	// Compile blocks on a separate thread, interpreting them until their
+	// code is ready, instead of stopping to compile them. Has no effect
+	// when the tier threshold is zero.
+	bool backgroundCompile;
+	// Number of times a compiled block runs before it's compiled again,
+	// laid out around how its tests and indirect jumps went. Until then
+	// it counts its entries and test outcomes. Zero never recompiles.
+	uint32_t hotThreshold;
+};
+
 class JITProcessor {
 public:
-	JITProcessor();
+	JITProcessor(const JITOptions& options=JITOptions());
 	~JITProcessor();
 
 	void inject(uint64_t cycles);
 	DCPUState& getState();
+
+	// Whether the last inject ended in a loop that waits for an interrupt
+	// and changes nothing else. Until one comes in, more cycles can be
+	// passed to skipIdle instead of being run.
+	bool idle() const;
+	void skipIdle(uint64_t cycles);
+
+	// Print code cache usage and the hit rate of every indirect jump, which
+	// is only counted in profile mode
+	void writeProfile(FILE* f);
+
+	// Runs and cycles of the instruction at each of the 0x10000 addresses,
+	// or NULL outside profile mode
+	const DCPUInsnCounts* insnCounts() const;
+
+	// Drop all generated code and every decoded block
+	void flushCodeCache();
+
+	// Compile every block reachable from entry without running anything,
+	// saving each to the translation cache directory if there is one.
+	// Returns the number of blocks compiled or loaded.
+	uint32_t precompile(uint16_t entry);
 private:
 	bool cycle();
 	void generateCode(); // Generate and cache the code for the current PC
+	JITBlockInfo& interpretedBlock(uint16_t pc); // Decode the block at pc if needed
+
+	bool installBlock(const JITCachedBlock& compiled);
+
+	// Translation cache directory support
+	uint32_t codeSettings();
+	bool loadSavedBlock(uint16_t pc, const JITBlockInfo& decoded);
+	void saveBlock(const JITCachedBlock& compiled);
+
+	// Background compilation
+	void compilerMain();
+	bool requestCompile(uint16_t pc, const JITTraceProfile* profile=NULL);
+	void installCompiled();
+
+	// Recompiling hot blocks
+	void promoteBlock(uint16_t pc);
+	void gatherProfile(const JITBlockInfo& info, JITTraceProfile& profile);
+
+	// Self-modifying code support
+	static bool onCodeWrite(void* ctx, uint16_t addr, uint32_t len);
+	bool invalidateRange(uint16_t addr, uint32_t len);
+	void invalidateBlock(uint16_t pc);
+	void registerBlock(uint16_t pc, const JITBlockInfo& info);
+	void clearPredictions();
+	void retireBranchCaches(JITBlockInfo& info);
+
+	// Block chaining
+	void linkBlock(uint8_t* site, uint16_t target);
+	void unlinkBlock(JITBlockInfo& info);
 
 	DCPUState m_state;
+	JITOptions m_options;
+	// Static cost of the block starting at each address
 	uint32_t* m_chunkCosts;
 	dcpu64Func* m_codeCache;
-	// Keep a list of marked addrs to speed up freeing
-	std::list<uint16_t> m_cacheAddrs;
+	// Where all generated code lives
+	JITCodeArena m_arena;
+	uint32_t m_flushes;
+	// Blocks loaded from and saved to the translation cache directory
+	uint32_t m_savedLoads;
+	uint32_t m_savedStores;
+	// Predicted return targets. Generated code holds its address.
+	JITReturnStack m_returnStack;
+	// Code jumped to by indirect jumps that miss their cache
+	void* m_lookupStub;
+	JITDispatchFunc m_dispatcher;
+	// Background compiler, and the queues to and from it. Only the
+	// emulation thread touches anything else.
+	boost::thread* m_compiler;
+	boost::lockfree::spsc_queue<JITCompileJob*,
+		boost::lockfree::capacity<JIT_COMPILE_QUEUE_SIZE> > m_compileRequests;
+	boost::lockfree::spsc_queue<JITCompileJob*,
+		boost::lockfree::capacity<JIT_COMPILE_QUEUE_SIZE> > m_compileResults;
+	boost::mutex m_compileLock;	// Only for waking the compiler
+	boost::condition_variable m_compileWake;
+	bool m_compilerStop;
+	uint32_t m_compilesInFlight;
+	// Start addresses of the blocks queued for compilation
+	std::vector<bool> m_compilePending;
+	// Entries left before the block starting at each address is
+	// recompiled, and the outcomes of the test at each address, counted
+	// by blocks that haven't been yet
+	uint32_t* m_blockCounts;
+	JITTestCounts* m_testCounts;
+	uint32_t m_promotions;
+	// Per-instruction counts, only kept in profile mode
+	DCPUInsnCounts* m_insnCounts;
+	// Pointed to by m_state.info.jitTable
+	void* m_table[JIT_TABLE_SIZE];
+	// Hits and misses of the caches of invalidated blocks, by jump address
+	std::map<uint16_t, std::pair<uint64_t, uint64_t> > m_retiredBranchCounts;
+	// Every live block keyed by start address, used for invalidation and freeing
+	std::map<uint16_t, JITBlockInfo> m_blocks;
+	// Owning block of every patchable exit
+	std::map<uint8_t*, uint16_t> m_exitOwners;
+	// Start addresses of the blocks decoded from each code page
+	std::vector<uint16_t> m_pageBlocks[DCPU_CODE_PAGES];
 };
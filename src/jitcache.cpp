@@ -0,0 +1,192 @@
+#include "jitcache.hpp"
+#include <stdio.h>
+#include <string.h>
+#include <stddef.h>
+#include <unistd.h>
+
+// Identifies the file format
+#define JIT_CACHE_MAGIC 0x314a4344	// "DCJ1"
+
+// Sanity limits on what an entry can hold
+#define JIT_CACHE_MAX_CODE (1 << 24)
+#define JIT_CACHE_MAX_OFFSETS 0x10000
+
+// Fixed-size start of an entry. It's followed by the ranges, the guest words
+// they cover, the exit and branch cache offsets, and the code.
+struct JITCacheHeader {
+	uint32_t magic;
+	uint32_t reserved;
+	uint64_t build;		// buildHash() of the writer
+	uint64_t key;
+	uint16_t pc;
+	uint16_t numRanges;
+	uint32_t chunkCost;
+	uint32_t numWords;
+	uint32_t numExits;
+	uint32_t numBranchCaches;
+	uint32_t codeSize;
+};
+
+// FNV-1a, over bytes
+static uint64_t hashBytes(uint64_t h, const void* data, size_t len) {
+	const uint8_t* p = (const uint8_t*)data;
+	for(size_t i=0;i < len;i++) {
+		h ^= p[i];
+		h *= 0x100000001b3ULL;
+	}
+	return h;
+}
+
+#define FNV_OFFSET_BASIS 0xcbf29ce484222325ULL
+
+// Entries are only shared by emulators that generate the same code and lay out
+// what it touches the same way. Codegen changes bump jitCodegenVersion; the
+// layout is checked here as well, in case a change to the structures misses it.
+static uint64_t buildHash() {
+	const uint32_t layout[] = {
+		jitCodegenVersion,
+		(uint32_t)sizeof(DCPURegisterInfo),
+		(uint32_t)offsetof(DCPURegisterInfo, cycles),
+		(uint32_t)offsetof(DCPURegisterInfo, memory),
+		(uint32_t)offsetof(DCPURegisterInfo, interruptsPending),
+		(uint32_t)offsetof(DCPURegisterInfo, statePtr),
+		(uint32_t)offsetof(DCPURegisterInfo, codePages),
+		(uint32_t)offsetof(DCPURegisterInfo, jitTable),
+		(uint32_t)offsetof(DCPURegisterInfo, blockHot),
+		JIT_TABLE_SIZE,
+		(uint32_t)sizeof(JITBranchCache),
+		(uint32_t)sizeof(JITReturnStack),
+		DCPU_CODE_PAGE_SHIFT
+	};
+	return hashBytes(FNV_OFFSET_BASIS, layout, sizeof(layout));
+}
+
+static uint32_t countWords(const std::vector<JITCodeRange>& ranges) {
+	uint32_t words = 0;
+	for(size_t r=0;r < ranges.size();r++)
+		words += ranges[r].length;
+	return words;
+}
+
+// Copy out the guest words a block covers, wrapping around the end of memory
+static void gatherWords(const std::vector<JITCodeRange>& ranges, const uint16_t* memory, std::vector<uint16_t>& words) {
+	for(size_t r=0;r < ranges.size();r++) {
+		for(uint32_t i=0;i < ranges[r].length;i++)
+			words.push_back(memory[(uint16_t)(ranges[r].start + i)]);
+	}
+}
+
+uint64_t jitCacheKey(uint16_t pc, const std::vector<JITCodeRange>& ranges,
+		const uint16_t* memory, uint32_t settings) {
+	uint64_t h = buildHash();
+	h = hashBytes(h, &settings, sizeof(settings));
+	h = hashBytes(h, &pc, sizeof(pc));
+	for(size_t r=0;r < ranges.size();r++) {
+		h = hashBytes(h, &ranges[r].start, sizeof(ranges[r].start));
+		h = hashBytes(h, &ranges[r].length, sizeof(ranges[r].length));
+	}
+	std::vector<uint16_t> words;
+	gatherWords(ranges, memory, words);
+	if(!words.empty())
+		h = hashBytes(h, &words[0], words.size()*sizeof(uint16_t));
+	return h;
+}
+
+static std::string entryPath(const std::string& dir, uint64_t key) {
+	char name[32];
+	snprintf(name, sizeof(name), "/%016llx.jit", (unsigned long long)key);
+	return dir + name;
+}
+
+template<typename T>
+static bool readArray(FILE* f, std::vector<T>& v, size_t n) {
+	v.resize(n);
+	return n == 0 || fread(&v[0], sizeof(T), n, f) == n;
+}
+
+template<typename T>
+static bool writeArray(FILE* f, const std::vector<T>& v) {
+	return v.empty() || fwrite(&v[0], sizeof(T), v.size(), f) == v.size();
+}
+
+bool jitCacheLoad(const std::string& dir, uint64_t key, const uint16_t* memory,
+		JITCachedBlock& block) {
+	FILE* f = fopen(entryPath(dir, key).c_str(), "rb");
+	if(f == NULL) return false;
+
+	JITCacheHeader h;
+	std::vector<JITCodeRange> ranges;
+	std::vector<uint16_t> words, expected;
+	bool ok = fread(&h, sizeof(h), 1, f) == 1 &&
+		h.magic == JIT_CACHE_MAGIC && h.build == buildHash() &&
+		h.key == key && h.pc == block.pc &&
+		h.numRanges == block.ranges.size() &&
+		h.numWords == countWords(block.ranges) &&
+		h.numExits <= JIT_CACHE_MAX_OFFSETS &&
+		h.numBranchCaches <= JIT_CACHE_MAX_OFFSETS &&
+		h.codeSize != 0 && h.codeSize <= JIT_CACHE_MAX_CODE &&
+		readArray(f, ranges, h.numRanges) &&
+		readArray(f, words, h.numWords) &&
+		readArray(f, block.exits, h.numExits) &&
+		readArray(f, block.branchCaches, h.numBranchCaches) &&
+		readArray(f, block.code, h.codeSize);
+	fclose(f);
+	if(!ok) return false;
+
+	// The entry has to be for exactly this code
+	for(size_t r=0;r < ranges.size();r++) {
+		if(ranges[r].start != block.ranges[r].start ||
+				ranges[r].length != block.ranges[r].length)
+			return false;
+	}
+	gatherWords(block.ranges, memory, expected);
+	if(words != expected) return false;
+
+	// Every offset has to point inside the code
+	for(size_t e=0;e < block.exits.size();e++) {
+		if(block.exits[e] + 5 > h.codeSize) return false;
+	}
+	for(size_t c=0;c < block.branchCaches.size();c++) {
+		if(block.branchCaches[c] + sizeof(JITBranchCache) > h.codeSize) return false;
+	}
+	block.chunkCost = h.chunkCost;
+	return true;
+}
+
+bool jitCacheStore(const std::string& dir, uint64_t key, const uint16_t* memory,
+		const JITCachedBlock& block) {
+	JITCacheHeader h;
+	memset(&h, 0, sizeof(h));
+	h.magic = JIT_CACHE_MAGIC;
+	h.build = buildHash();
+	h.key = key;
+	h.pc = block.pc;
+	h.numRanges = block.ranges.size();
+	h.chunkCost = block.chunkCost;
+	h.numWords = countWords(block.ranges);
+	h.numExits = block.exits.size();
+	h.numBranchCaches = block.branchCaches.size();
+	h.codeSize = block.code.size();
+
+	std::vector<uint16_t> words;
+	gatherWords(block.ranges, memory, words);
+
+	std::string path = entryPath(dir, key);
+	char suffix[32];
+	snprintf(suffix, sizeof(suffix), ".%d.tmp", (int)getpid());
+	std::string tmp = path + suffix;
+	FILE* f = fopen(tmp.c_str(), "wb");
+	if(f == NULL) return false;
+	bool ok = fwrite(&h, sizeof(h), 1, f) == 1 &&
+		writeArray(f, block.ranges) &&
+		writeArray(f, words) &&
+		writeArray(f, block.exits) &&
+		writeArray(f, block.branchCaches) &&
+		writeArray(f, block.code);
+	if(fclose(f) != 0) ok = false;
+	if(!ok || rename(tmp.c_str(), path.c_str()) != 0) {
+		remove(tmp.c_str());
+		return false;
+	}
+	return true;
+}
@@ -0,0 +1,38 @@
+#pragma once
+#include <stdint.h>
+#include <string>
+#include <vector>
+#include "jit.hpp"
+
+// A translated block as it's kept in a translation cache directory. Generated
+// code reaches everything outside itself through DCPURegisterInfo::jitTable,
+// so the code can be copied anywhere and run as it is.
+struct JITCachedBlock {
+	uint16_t pc;
+	std::vector<JITCodeRange> ranges;	// Guest words the block was decoded from
+	uint32_t chunkCost;			// Its m_chunkCosts entry
+	std::vector<uint8_t> code;		// As generated, with no exits patched
+	std::vector<uint32_t> exits;		// Offsets of the chainable jumps
+	std::vector<uint32_t> branchCaches;	// Offsets of the indirect jump caches
+};
+
+// Version of the code the JIT generates, defined with the code generator.
+// Entries written by a different version never match.
+extern const uint32_t jitCodegenVersion;
+
+// Key for the translation of the block at pc, decoded from the given ranges of
+// memory. settings holds whatever else changes the generated code.
+uint64_t jitCacheKey(uint16_t pc, const std::vector<JITCodeRange>& ranges,
+		const uint16_t* memory, uint32_t settings);
+
+// Read the entry for key from dir. block.pc and block.ranges must already be
+// set; the entry only loads if it was made from the same block and the same
+// words of memory, so a hash collision can't bring in the wrong code.
+bool jitCacheLoad(const std::string& dir, uint64_t key, const uint16_t* memory,
+		JITCachedBlock& block);
+
+// Write the entry for key to dir. Entries are written under a temporary name
+// and renamed into place, so processes sharing the directory never see a
+// partial one.
+bool jitCacheStore(const std::string& dir, uint64_t key, const uint16_t* memory,
+		const JITCachedBlock& block);
@@ -0,0 +1,342 @@
+#include "jitir.hpp"
+
+// Bits for the guest registers in the masks used by the passes. A through J
+// use their DCPUValue::Register numbers.
+#define IR_SP (1 << 8)
+#define IR_EX (1 << 9)
+#define IR_ALL 0x3ff
+#define IR_EX_INDEX 9
+
+void jitBuildIR(const std::vector<DCPUInsn>& insns, const std::vector<bool>& followed, JITIRBlock& block) {
+	block.resize(insns.size());
+	for(size_t n=0;n < insns.size();n++) {
+		block[n].insn = insns[n];
+		block[n].followed = followed[n];
+		block[n].flags = 0;
+		block[n].exValue = 0;
+	}
+}
+
+// Registers used to compute the address of a memory operand, including SP
+// for the stack forms
+static uint32_t addressSlots(const DCPUValue& v) {
+	switch(v.val) {
+		case DCPUValue::VT_INDIRECT_REGISTER:
+		case DCPUValue::VT_INDIRECT_REGISTER_OFFSET:
+			return 1 << v.reg;
+		case DCPUValue::VT_PUSHPOP:
+		case DCPUValue::VT_PEEK:
+		case DCPUValue::VT_PICK:
+			return IR_SP;
+		default:
+			return 0;
+	}
+}
+
+// The register an operand names directly, if any
+static uint32_t directSlot(const DCPUValue& v) {
+	switch(v.val) {
+		case DCPUValue::VT_REGISTER:
+			return 1 << v.reg;
+		case DCPUValue::VT_SP:
+			return IR_SP;
+		case DCPUValue::VT_EX:
+			return IR_EX;
+		default:
+			return 0;
+	}
+}
+
+static bool writesEX(const JITIRInsn& ir) {
+	switch(ir.insn.op) {
+		case DO_ADD:
+		case DO_SUB:
+		case DO_MUL:
+		case DO_MLI:
+		case DO_DIV:
+		case DO_DVI:
+		case DO_SHR:
+		case DO_ASR:
+		case DO_SHL:
+		case DO_ADX:
+		case DO_SBX:
+			return true;
+		case DO_SET:
+			return (ir.flags & JIT_IR_SETS_EX) != 0;
+		default:
+			return false;
+	}
+}
+
+// Whether an instruction reads the value of its b operand, and not just its
+// address
+static bool readsB(DCPUInsn inst) {
+	switch(inst.op) {
+		case DO_SET:
+		case DO_STI:
+		case DO_STD:
+			return false;
+		default:
+			return true;
+	}
+}
+
+// Whether the a operand of a special instruction is written instead of read
+static bool writesA(DCPUInsn inst) {
+	return inst.op == DO_IAG || inst.op == DO_HWN;
+}
+
+// Registers an instruction reads
+static uint32_t insnReads(const JITIRInsn& ir) {
+	DCPUInsn inst = ir.insn;
+	uint32_t slots = addressSlots(inst.a);
+	if(!writesA(inst))
+		slots |= directSlot(inst.a);
+	if(hasBValue(inst)) {
+		slots |= addressSlots(inst.b);
+		if(readsB(inst))
+			slots |= directSlot(inst.b);
+	}
+	switch(inst.op) {
+		case DO_ADX:
+		case DO_SBX:
+			slots |= IR_EX;
+			break;
+		case DO_STI:
+		case DO_STD:
+			slots |= (1 << DCPUValue::I) | (1 << DCPUValue::J);
+			break;
+		case DO_JSR:
+		case DO_RFI:
+			slots |= IR_SP;
+			break;
+		default:
+			break;
+	}
+	return slots;
+}
+
+// Registers an instruction writes, if it isn't skipped
+static uint32_t insnWrites(const JITIRInsn& ir) {
+	DCPUInsn inst = ir.insn;
+	uint32_t slots = 0;
+	if(inst.a.val == DCPUValue::VT_PUSHPOP)
+		slots |= IR_SP;
+	if(writesA(inst))
+		slots |= directSlot(inst.a);
+	if(hasBValue(inst) && !isConditionalInsn(inst)) {
+		slots |= directSlot(inst.b);
+		if(inst.b.val == DCPUValue::VT_PUSHPOP)
+			slots |= IR_SP;
+	}
+	if(writesEX(ir))
+		slots |= IR_EX;
+	switch(inst.op) {
+		case DO_STI:
+		case DO_STD:
+			slots |= (1 << DCPUValue::I) | (1 << DCPUValue::J);
+			break;
+		case DO_JSR:
+			slots |= IR_SP;
+			break;
+		case DO_RFI:
+			slots |= IR_SP | (1 << DCPUValue::A);
+			break;
+		case DO_HWQ:
+			slots |= (1 << DCPUValue::A) | (1 << DCPUValue::B) |
+				(1 << DCPUValue::C) | (1 << DCPUValue::X) | (1 << DCPUValue::Y);
+			break;
+		default:
+			break;
+	}
+	return slots;
+}
+
+// Evaluate an instruction with known operands. Returns false if it can't be
+// folded.
+static bool foldInsn(DCPUOpcode op, uint16_t b, uint16_t a, uint16_t& result, uint16_t& ex) {
+	uint32_t bv = b, av = a;
+	int32_t bs = (int16_t)b, as = (int16_t)a;
+	switch(op) {
+		case DO_ADD:
+			result = bv + av;
+			ex = (bv + av > 0xffff) ? 1 : 0;
+			return true;
+		case DO_SUB:
+			result = bv - av;
+			ex = (av > bv) ? 0xffff : 0;
+			return true;
+		case DO_MUL:
+			result = bv * av;
+			ex = (bv * av) >> 16;
+			return true;
+		case DO_MLI:
+			result = (uint32_t)(bs * as);
+			ex = (uint32_t)(bs * as) >> 16;
+			return true;
+		case DO_AND:
+			result = b & a;
+			return true;
+		case DO_BOR:
+			result = b | a;
+			return true;
+		case DO_XOR:
+			result = b ^ a;
+			return true;
+		case DO_SHR:
+			if(av > 31) return false;
+			result = ((bv << 16) >> av) >> 16;
+			ex = (bv << 16) >> av;
+			return true;
+		case DO_SHL:
+			if(av > 31) return false;
+			result = bv << av;
+			ex = (bv << av) >> 16;
+			return true;
+		default:
+			return false;
+	}
+}
+
+// Rewrite an operand to use the known values of the registers it reads.
+// Direct register reads are only replaced if value is set.
+static void substituteOperand(DCPUValue& v, const bool* known, const uint16_t* values, bool value) {
+	switch(v.val) {
+		case DCPUValue::VT_REGISTER:
+			if(!value || !known[v.reg]) return;
+			v.nextWord = values[v.reg];
+			v.val = DCPUValue::VT_LITERAL;
+			break;
+		case DCPUValue::VT_EX:
+			if(!value || !known[IR_EX_INDEX]) return;
+			v.nextWord = values[IR_EX_INDEX];
+			v.val = DCPUValue::VT_LITERAL;
+			break;
+		case DCPUValue::VT_INDIRECT_REGISTER:
+			if(!known[v.reg]) return;
+			v.nextWord = values[v.reg];
+			v.val = DCPUValue::VT_MEMORY;
+			break;
+		case DCPUValue::VT_INDIRECT_REGISTER_OFFSET:
+			if(!known[v.reg]) return;
+			v.nextWord += values[v.reg];
+			v.val = DCPUValue::VT_MEMORY;
+			break;
+		default:
+			break;
+	}
+}
+
+void jitPropagateConstants(JITIRBlock& block) {
+	// Known values of A through J and EX. SP isn't tracked.
+	bool known[IR_EX_INDEX+1];
+	uint16_t values[IR_EX_INDEX+1];
+	for(int i=0;i <= IR_EX_INDEX;i++)
+		known[i] = false;
+
+	for(size_t n=0;n < block.size();n++) {
+		JITIRInsn& ir = block[n];
+		DCPUInsn& inst = ir.insn;
+		bool guarded = (n > 0 && isConditionalInsn(block[n-1].insn));
+
+		// PC always reads as the address of the next instruction
+		if(inst.a.val == DCPUValue::VT_PC && !writesA(inst)) {
+			inst.a.val = DCPUValue::VT_LITERAL;
+			inst.a.nextWord = inst.nextOffset;
+		}
+		substituteOperand(inst.a, known, values, !writesA(inst));
+		if(hasBValue(inst)) {
+			// Only tests read b without writing it
+			bool test = isConditionalInsn(inst);
+			if(test && inst.b.val == DCPUValue::VT_PC) {
+				inst.b.val = DCPUValue::VT_LITERAL;
+				inst.b.nextWord = inst.nextOffset;
+			}
+			substituteOperand(inst.b, known, values, test);
+		}
+
+		// Fold arithmetic on a general register with a known value into a
+		// SET, which also stores EX if the instruction would have
+		uint16_t result, ex = 0;
+		if(!ir.followed && inst.op != DO_SET && hasBValue(inst) &&
+				inst.b.val == DCPUValue::VT_REGISTER && known[inst.b.reg] &&
+				inst.a.val == DCPUValue::VT_LITERAL &&
+				foldInsn(inst.op, values[inst.b.reg], inst.a.nextWord, result, ex)) {
+			if(writesEX(ir)) {
+				ir.flags |= JIT_IR_SETS_EX;
+				ir.exValue = ex;
+			}
+			inst.op = DO_SET;
+			inst.a.nextWord = result;
+		}
+
+		// Registers written by skippable instructions end up unknown
+		uint32_t writes = insnWrites(ir);
+		for(int i=0;i <= IR_EX_INDEX;i++) {
+			if(writes & (1 << i)) known[i] = false;
+		}
+		if(guarded) continue;
+		if(inst.op == DO_SET && inst.a.val == DCPUValue::VT_LITERAL) {
+			if(inst.b.val == DCPUValue::VT_REGISTER) {
+				known[inst.b.reg] = true;
+				values[inst.b.reg] = inst.a.nextWord;
+			} else if(inst.b.val == DCPUValue::VT_EX) {
+				known[IR_EX_INDEX] = true;
+				values[IR_EX_INDEX] = inst.a.nextWord;
+			}
+		}
+		if(ir.flags & JIT_IR_SETS_EX) {
+			known[IR_EX_INDEX] = true;
+			values[IR_EX_INDEX] = ir.exValue;
+		}
+	}
+}
+
+// Whether an instruction has no effect besides writing the registers in
+// insnWrites, so it can be dropped if none of them are read
+static bool isRemovable(const JITIRInsn& ir) {
+	DCPUInsn inst = ir.insn;
+	if(ir.followed || inst.op > DO_SBX || isConditionalInsn(inst)) return false;
+	if(directSlot(inst.b) == 0) return false;
+	return inst.a.val != DCPUValue::VT_PUSHPOP;
+}
+
+void jitEliminateDeadStores(JITIRBlock& block) {
+	// Everything is live when the block is left at the end
+	uint32_t live = IR_ALL;
+	for(size_t n=block.size();n-- > 0;) {
+		JITIRInsn& ir = block[n];
+		DCPUInsn inst = ir.insn;
+		bool guarded = (n > 0 && isConditionalInsn(block[n-1].insn));
+
+		// Stores to memory are followed by a check that can leave the
+		// block, and jumps that aren't followed leave it
+		if((!ir.followed && insnWritesPC(inst)) || insnWritesMemory(inst) ||
+				inst.op == DO_HWI || inst.op == DO_INVALID)
+			live = IR_ALL;
+
+		uint32_t writes = insnWrites(ir);
+		if(isRemovable(ir) && (writes & live) == 0) {
+			ir.flags |= JIT_IR_DEAD;
+			continue;
+		}
+		if(writesEX(ir) && (live & IR_EX) == 0)
+			ir.flags |= JIT_IR_EX_DEAD;
+
+		// Skippable instructions don't hide what was written before them
+		if(!guarded)
+			live &= ~writes;
+		live |= insnReads(ir);
+
+		// Followed jumps that can be skipped have a side exit, and
+		// hardware may look at any register
+		if((ir.followed && guarded) || inst.op == DO_HWI)
+			live = IR_ALL;
+	}
+}
+
+void jitOptimizeIR(JITIRBlock& block, bool exitBeforeEveryInsn) {
+	jitPropagateConstants(block);
+	if(!exitBeforeEveryInsn)
+		jitEliminateDeadStores(block);
+}
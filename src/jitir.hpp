@@ -0,0 +1,42 @@
+#pragma once
+#include <vector>
+#include "dcpu.hpp"
+
+// Flags the optimization passes set on IR instructions
+#define JIT_IR_DEAD	0x01	// Nothing reads what it writes, so only its cost is charged
+#define JIT_IR_EX_DEAD	0x02	// Nothing reads the EX value it writes
+#define JIT_IR_SETS_EX	0x04	// Also stores exValue to EX. Only set on folded SETs.
+
+// One instruction of a block in the JIT's intermediate representation, which
+// is the list of instructions in the order they're emitted. Passes rewrite
+// them in place, but the offsets and cycle cost of an instruction always stay
+// those of the one it was decoded as.
+struct JITIRInsn {
+	DCPUInsn insn;
+	bool followed;		// The trace carries on at the target of this jump
+	uint8_t flags;
+	uint16_t exValue;	// Stored to EX with JIT_IR_SETS_EX
+};
+typedef std::vector<JITIRInsn> JITIRBlock;
+
+// Build the IR for a trace, as returned by decodeTrace
+void jitBuildIR(const std::vector<DCPUInsn>& insns, const std::vector<bool>& followed, JITIRBlock& block);
+
+// Replace reads of registers with known values by literals, and fold
+// arithmetic on them into SETs
+void jitPropagateConstants(JITIRBlock& block);
+
+// Mark instructions whose results are overwritten before anything reads them,
+// and EX values that are never read. Every register is taken to be read
+// wherever the block can be left.
+void jitEliminateDeadStores(JITIRBlock& block);
+
+// Run every pass. When interrupts are polled for before each instruction,
+// the block can be left anywhere, so nothing is eliminated.
+void jitOptimizeIR(JITIRBlock& block, bool exitBeforeEveryInsn);
+
+// Instruction properties, shared with the code generator
+bool isConditionalInsn(DCPUInsn inst);
+bool hasBValue(DCPUInsn inst);
+bool insnWritesPC(DCPUInsn inst);
+bool insnWritesMemory(DCPUInsn inst);
@@ -2,12 +2,15 @@
 #include <iostream>
 #include <stdlib.h>
 #include <string>
+#include <algorithm>
+#include <signal.h>
 #include <boost/chrono.hpp>
 #include <boost/thread.hpp>
 #include <boost/program_options.hpp>
 
 #include "dcpu.hpp"
 #include "jit.hpp"
+#include "profile.hpp"
 #include "hw/clock.hpp"
 
 #define BENCHMARK_CYCLES 100000000
@@ -15,6 +18,12 @@
 // The smallest number of cycles that will be executed at a time
 #define CYCLE_ATOM 100
 
+// Most atoms slept through at once while the guest waits for an interrupt
+#define IDLE_ATOMS 1000
+
+// Cycles run at a time when running at full speed
+#define RUN_SLICE 10000000
+
 using namespace std;
 namespace po = boost::program_options;
 namespace chron = boost::chrono;
@@ -30,22 +39,61 @@ std::string makeFancyUnit(double val, char* units) {
 	return std::string(buf);
 }
 
+// Set by SIGINT or SIGTERM in profile mode, to stop the run so the profile can
+// be written
+static volatile sig_atomic_t stopRequested = 0;
+
+static void requestStop(int sig) {
+	stopRequested = 1;
+	// A second signal kills the process as usual
+	signal(sig, SIG_DFL);
+}
+
 void printInsn(DCPUInsn i) {
 	printf("Insn: %d %d %d %d %d %d\n", i.op, i.cycleCost, i.a.val, i.a.nextWord, i.b.val, i.b.nextWord);
 }
 
+// Run CYCLE_ATOM cycles, then sleep until they're due to have taken atomTime.
+// While the guest waits for an interrupt, the thread sleeps until one is
+// queued instead of waking every atom, for up to IDLE_ATOMS atoms and limit
+// cycles, and the atoms slept through are skipped. Returns the number of
+// cycles that passed.
+static uint64_t runPaced(JITProcessor& proc, chron::high_resolution_clock::duration atomTime, uint64_t limit) {
+	chron::high_resolution_clock::time_point start = chron::high_resolution_clock::now();
+	proc.inject(CYCLE_ATOM);
+	uint64_t atoms = 1;
+	uint64_t most = std::min<uint64_t>(IDLE_ATOMS, limit / CYCLE_ATOM);
+	if(proc.idle() && most > 1) {
+		proc.getState().waitForInterrupt(start + atomTime*most);
+		atoms = (chron::high_resolution_clock::now() - start) / atomTime;
+		atoms = std::max<uint64_t>(1, std::min(atoms, most));
+		proc.skipIdle((atoms-1)*CYCLE_ATOM);
+	}
+	boost::this_thread::sleep_until(start + atomTime*atoms);
+	return atoms*CYCLE_ATOM;
+}
+
 int main(int argc, char **argv) {
 	po::options_description optDesc;
 	optDesc.add_options()
 		("sped", "Attach a SPED-3 Suspended Particle Exciter Display to the simulated DCPU")
 		("lem", "Attach a LEM1802 Low Energy Monitor to the simulated DCPU")
 		("bench", "Enable benchmarking mode. No hardware is attached, and statistics on emulation speed will be printed when emulation is complete")
-		("profile", "Enable profiling mode. In profiling mode, tracepoints are generated in the generated machine code and a file with per-instruction statistics will be emitted")
+		("profile", "Enable profiling mode. In profiling mode, tracepoints are generated in the generated machine code and a file with per-instruction statistics will be emitted when the run ends, or when it's stopped with Ctrl-C")
+		("profile-file", po::value<std::string>()->default_value("dcpu.prof"), "The file to write per-instruction statistics to in profiling mode")
+		("profile-binary", "Write per-instruction statistics as binary records instead of CSV")
+		("labels", po::value<std::string>(), "Assembler label map, with a label and a hex address on each line, to name instructions in the profile with")
 		("test", "Enable testing mode. After emulation, the machine state will be dumped to the console")
 		("test-mem", "Enable memory dumps after emulation in testing mode")
 		("dump-file", po::value<std::string>()->default_value("dcpu.mem"), "The file to dump memory to")
-		("cycles", po::value<uint64_t>()->default_value(0), "Limit the number of cycles the emulator can run for")
+		("cycles", po::value<uint64_t>()->default_value(0), "Limit the number of cycles the emulator can run for (0 runs until stopped)")
 		("speed", po::value<float>(), "Maximum speed in KHz the emulated DCPU will run at")
+		("block-cycles", "Charge cycles and poll for interrupts once per block of generated code instead of before every instruction. Faster, but interrupts can be taken up to a block late")
+		("code-cache", po::value<uint32_t>()->default_value(JIT_DEFAULT_CODE_CACHE_SIZE >> 10), "Size in KiB of the generated code cache, which is flushed when full")
+		("jit-cache", po::value<std::string>(), "Directory compiled blocks are saved to and loaded from, so later runs can skip compiling them")
+		("jit-background", "Compile blocks on a separate thread, interpreting them until their code is ready")
+		("jit-threshold", po::value<uint32_t>()->default_value(JIT_DEFAULT_TIER_THRESHOLD), "Number of times a block is interpreted before it's compiled (0 compiles immediately)")
+		("jit-hot-threshold", po::value<uint32_t>()->default_value(0), "Number of times a compiled block runs before it's recompiled around how its tests and jumps went (0 never recompiles)")
 		("help", "Print a help message")
 		("image", po::value<std::string>(), "The program image to load")
 		("little-endian,l", "Load a little-endian input file instead of a big-endian one")
@@ -64,8 +112,24 @@ int main(int argc, char **argv) {
 		return 1;
 	}
 	
-	JITProcessor proc;
+	JITOptions options;
+	if(vmap.count("block-cycles"))
+		options.cycleMode = JIT_CYCLES_PER_BLOCK;
+	options.tierThreshold = vmap["jit-threshold"].as<uint32_t>();
+	options.hotThreshold = vmap["jit-hot-threshold"].as<uint32_t>();
+	options.profile = (vmap.count("profile") != 0);
+	options.codeCacheSize = (size_t)vmap["code-cache"].as<uint32_t>() << 10;
+	options.backgroundCompile = (vmap.count("jit-background") != 0);
+	if(vmap.count("jit-cache"))
+		options.translationCache = vmap["jit-cache"].as<std::string>();
+	JITProcessor proc(options);
 	
+	DCPUSymbolMap symbols;
+	if(vmap.count("labels") && !loadSymbolMap(vmap["labels"].as<std::string>(), symbols)) {
+		fprintf(stderr, "ERROR: Cannot read label map\n");
+		return 1;
+	}
+
 	// Load the program
 	FILE* loadFile = fopen(vmap["image"].as<std::string>().c_str(), "rb");
 	if(loadFile != NULL) {
@@ -104,33 +168,40 @@ int main(int argc, char **argv) {
 		start = clk.now();
 	}
 	
-	// Run the processor
+	if(options.profile) {
+		signal(SIGINT, requestStop);
+		signal(SIGTERM, requestStop);
+	}
+
+	// Run the processor. Without a limit, benchmarks run BENCHMARK_CYCLES.
+	uint64_t limit = vmap["cycles"].as<uint64_t>();
+	if(benchmarking && limit == 0)
+		limit = BENCHMARK_CYCLES;
 	if(vmap.count("speed")) {
 		// The speed is limited, so we have to do more complex cycle limiting
 		float maxSpeed = vmap["speed"].as<float>()*1000;
-		boost::chrono::high_resolution_clock::time_point nextCycle;
 		boost::chrono::duration<double, boost::ratio<1> > cycleTime(1.0f/maxSpeed);
 		chron::high_resolution_clock::duration clkCycles =
 			chron::round<chron::high_resolution_clock::duration>(cycleTime);
-		if(vmap.count("cycles")) {
-			int64_t cycles = vmap["cycles"].as<uint64_t>();
-			for(;cycles > 0;cycles -= CYCLE_ATOM) {
-				nextCycle = clk.now()+(clkCycles*CYCLE_ATOM);
-				proc.inject(CYCLE_ATOM);
-				boost::this_thread::sleep_until(nextCycle);
-			}
+		if(limit != 0) {
+			int64_t cycles = limit;
+			while(cycles > 0 && !stopRequested)
+				cycles -= runPaced(proc, clkCycles*CYCLE_ATOM, cycles);
 		} else {
-			while(true) {
-				nextCycle = clk.now()+(clkCycles*CYCLE_ATOM);
-				proc.inject(CYCLE_ATOM);
-				boost::this_thread::sleep_until(nextCycle);
-			}
+			while(!stopRequested && !proc.getState().ignited)
+				runPaced(proc, clkCycles*CYCLE_ATOM, IDLE_ATOMS*CYCLE_ATOM);
 		}
 	} else {
-		if(vmap.count("cycles")) {
-			proc.inject(vmap["cycles"].as<uint64_t>());
+		if(limit != 0) {
+			uint64_t cycles = limit;
+			while(cycles > 0 && !stopRequested) {
+				uint64_t slice = std::min<uint64_t>(cycles, RUN_SLICE);
+				proc.inject(slice);
+				cycles -= slice;
+			}
 		} else {
-			while(true) proc.inject(10000000);
+			while(!stopRequested && !proc.getState().ignited)
+				proc.inject(RUN_SLICE);
 		}
 	}
 
@@ -146,6 +217,23 @@ int main(int argc, char **argv) {
 		printf("Clock Frequency: %s\n", makeFancyUnit(freq, "Hz").c_str());
 		printf("Elapsed Clocks: %d\n", proc.getState().elapsed);
 	}
+	if(options.profile) {
+		fflush(stdout);
+		proc.writeProfile(stderr);
+
+		bool binary = (vmap.count("profile-binary") != 0);
+		FILE* report = fopen(vmap["profile-file"].as<std::string>().c_str(), binary ? "wb" : "w");
+		bool written = (report != NULL);
+		if(written) {
+			if(binary)
+				written = writeProfileBinary(report, proc.insnCounts());
+			else
+				written = writeProfileCSV(report, proc.insnCounts(), symbols);
+			if(fclose(report) != 0) written = false;
+		}
+		if(!written)
+			fprintf(stderr, "ERROR: Cannot write profile file\n");
+	}
 	if(vmap.count("test")) {
 		DCPURegisterInfo i = proc.getState().info;
 		printf("A  = %04x\n", i.a);
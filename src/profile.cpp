@@ -0,0 +1,98 @@
+#include "profile.hpp"
+#include <stdlib.h>
+#include <string.h>
+#include <algorithm>
+#include <vector>
+
+bool loadSymbolMap(const std::string& path, DCPUSymbolMap& symbols) {
+	FILE* f = fopen(path.c_str(), "r");
+	if(f == NULL) return false;
+
+	char line[512];
+	bool ok = true;
+	while(ok && fgets(line, sizeof(line), f) != NULL) {
+		char* name = strtok(line, " \t\r\n");
+		if(name == NULL || name[0] == ';' || name[0] == '#') continue;
+		if(name[0] == ':') name++;
+
+		char* addr = strtok(NULL, " \t\r\n");
+		char* end = NULL;
+		unsigned long value = (addr == NULL) ? 0 : strtoul(addr, &end, 16);
+		if(name[0] == '\0' || addr == NULL || *end != '\0' || value > 0xffff) {
+			ok = false;
+			break;
+		}
+		symbols[(uint16_t)value] = name;
+	}
+	fclose(f);
+	return ok;
+}
+
+// Orders addresses by the cycles spent at them, most first
+struct ProfileOrder {
+	const DCPUInsnCounts* counts;
+	bool operator()(uint32_t a, uint32_t b) const {
+		if(counts[a].cycles != counts[b].cycles)
+			return counts[a].cycles > counts[b].cycles;
+		return a < b;
+	}
+};
+
+// Addresses of every instruction that ran, in report order
+static void sortedAddresses(const DCPUInsnCounts* counts, std::vector<uint32_t>& addrs) {
+	for(uint32_t addr=0;addr < 0x10000;addr++) {
+		if(counts[addr].executions != 0 || counts[addr].cycles != 0)
+			addrs.push_back(addr);
+	}
+	ProfileOrder order;
+	order.counts = counts;
+	std::sort(addrs.begin(), addrs.end(), order);
+}
+
+bool writeProfileCSV(FILE* f, const DCPUInsnCounts* counts, const DCPUSymbolMap& symbols) {
+	std::vector<uint32_t> addrs;
+	sortedAddresses(counts, addrs);
+	uint64_t total = 0;
+	for(size_t n=0;n < addrs.size();n++)
+		total += counts[addrs[n]].cycles;
+
+	fprintf(f, "address,symbol,executions,cycles,percent\n");
+	for(size_t n=0;n < addrs.size();n++) {
+		uint16_t addr = addrs[n];
+		std::string name;
+		DCPUSymbolMap::const_iterator sym = symbols.upper_bound(addr);
+		if(sym != symbols.begin()) {
+			--sym;
+			char offset[16];
+			name = sym->second;
+			if(sym->first != addr) {
+				snprintf(offset, sizeof(offset), "+%u", (unsigned)(addr - sym->first));
+				name += offset;
+			}
+		}
+		const DCPUInsnCounts& c = counts[addr];
+		fprintf(f, "0x%04x,%s,%llu,%llu,%.2f\n", addr, name.c_str(),
+			(unsigned long long)c.executions, (unsigned long long)c.cycles,
+			(total == 0) ? 0.0 : 100.0*c.cycles/total);
+	}
+	return ferror(f) == 0;
+}
+
+bool writeProfileBinary(FILE* f, const DCPUInsnCounts* counts) {
+	std::vector<uint32_t> addrs;
+	sortedAddresses(counts, addrs);
+
+	DCPUProfileHeader h;
+	h.magic = DCPU_PROFILE_MAGIC;
+	h.records = addrs.size();
+	if(fwrite(&h, sizeof(h), 1, f) != 1) return false;
+	for(size_t n=0;n < addrs.size();n++) {
+		DCPUProfileRecord r;
+		memset(&r, 0, sizeof(r));
+		r.address = addrs[n];
+		r.executions = counts[addrs[n]].executions;
+		r.cycles = counts[addrs[n]].cycles;
+		if(fwrite(&r, sizeof(r), 1, f) != 1) return false;
+	}
+	return true;
+}
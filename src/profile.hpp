@@ -0,0 +1,37 @@
+#pragma once
+#include <stdio.h>
+#include <stdint.h>
+#include <map>
+#include <string>
+#include "dcpu.hpp"
+
+// Label names by address, for naming the instructions in a profile report
+typedef std::map<uint16_t, std::string> DCPUSymbolMap;
+
+// Read an assembler label map. Each line holds a label and its address in
+// hex, like "loop 0x0012"; a ':' before the label is dropped, and blank lines
+// and ones starting with ';' or '#' are skipped. Returns false if the file
+// can't be opened or a line can't be read.
+bool loadSymbolMap(const std::string& path, DCPUSymbolMap& symbols);
+
+// Identifies the binary report format
+#define DCPU_PROFILE_MAGIC 0x52504344	// "DCPR"
+
+// The binary report is this header, followed by a record for every
+// instruction that ran, most cycles first. Both are in host byte order.
+struct DCPUProfileHeader {
+	uint32_t magic;
+	uint32_t records;
+};
+
+struct DCPUProfileRecord {
+	uint16_t address;
+	uint16_t reserved[3];
+	uint64_t executions;
+	uint64_t cycles;
+};
+
+// Write a report of every instruction that ran, most cycles first. The CSV
+// report names each address after the nearest label at or before it.
+bool writeProfileCSV(FILE* f, const DCPUInsnCounts* counts, const DCPUSymbolMap& symbols);
+bool writeProfileBinary(FILE* f, const DCPUInsnCounts* counts);
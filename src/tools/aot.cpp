@@ -0,0 +1,61 @@
+// Compiles a program image ahead of time. Every block reachable from the
+// entry point is translated and saved to a translation cache directory, which
+// the emulator loads with --jit-cache. Anything the search can't find, like
+// the targets of computed jumps, or code the program changes later is still
+// compiled when it's run.
+#include <stdio.h>
+#include <iostream>
+#include <string>
+#include <boost/program_options.hpp>
+
+#include "../dcpu.hpp"
+#include "../jit.hpp"
+
+namespace po = boost::program_options;
+
+int main(int argc, char** argv) {
+	po::options_description optDesc("Options");
+	optDesc.add_options()
+		("output,o", po::value<std::string>(), "The translation cache directory to write to")
+		("entry", po::value<uint16_t>()->default_value(0), "Address to start searching for code from")
+		("block-cycles", "Compile for an emulator run with --block-cycles")
+		("profile", "Compile for an emulator run with --profile")
+		("jit-hot-threshold", po::value<uint32_t>()->default_value(0), "Compile for an emulator run with this --jit-hot-threshold")
+		("help", "Print a help message")
+		("image", po::value<std::string>(), "The program image to compile")
+		("little-endian,l", "Load a little-endian input file instead of a big-endian one")
+	;
+
+	po::positional_options_description posOptDesc;
+	posOptDesc.add("image", 1);
+
+	po::variables_map vmap;
+	po::store(po::command_line_parser(argc, argv).options(optDesc).positional(posOptDesc).run(), vmap);
+	po::notify(vmap);
+
+	if(vmap.count("image") == 0 || vmap.count("output") == 0 || vmap.count("help") > 0) {
+		optDesc.print(std::cout);
+		fprintf(stderr, "ERROR: Program image and output directory are required\n");
+		return 1;
+	}
+
+	JITOptions options;
+	if(vmap.count("block-cycles"))
+		options.cycleMode = JIT_CYCLES_PER_BLOCK;
+	options.profile = (vmap.count("profile") != 0);
+	options.hotThreshold = vmap["jit-hot-threshold"].as<uint32_t>();
+	options.translationCache = vmap["output"].as<std::string>();
+	JITProcessor proc(options);
+
+	FILE* loadFile = fopen(vmap["image"].as<std::string>().c_str(), "rb");
+	if(loadFile == NULL) {
+		fprintf(stderr, "ERROR: Cannot open input file\n");
+		return 1;
+	}
+	proc.getState().loadFromFile(loadFile, vmap.count("little-endian")==0);
+	fclose(loadFile);
+
+	uint32_t blocks = proc.precompile(vmap["entry"].as<uint16_t>());
+	printf("%u blocks compiled\n", blocks);
+	return 0;
+}
@@ -0,0 +1,85 @@
+// Compares the table-driven instruction decoder with the reference one. Every
+// possible first word is checked for identical results, then both decoders
+// are timed over memory filled with random words.
+#include "../dcpu.hpp"
+#include <string.h>
+#include <boost/chrono.hpp>
+
+static bool sameValue(const DCPUValue& x, const DCPUValue& y) {
+	if(x.val != y.val || x.b != y.b) return false;
+	switch(x.val) {
+		case DCPUValue::VT_REGISTER:
+		case DCPUValue::VT_INDIRECT_REGISTER:
+			return x.reg == y.reg;
+		case DCPUValue::VT_INDIRECT_REGISTER_OFFSET:
+			return x.reg == y.reg && x.nextWord == y.nextWord;
+		case DCPUValue::VT_PICK:
+		case DCPUValue::VT_MEMORY:
+		case DCPUValue::VT_LITERAL:
+			return x.nextWord == y.nextWord;
+		default:
+			return true;
+	}
+}
+
+static bool sameInsn(const DCPUInsn& x, const DCPUInsn& y) {
+	if(x.op != y.op || x.offset != y.offset || x.nextOffset != y.nextOffset ||
+			x.cycleCost != y.cycleCost)
+		return false;
+	if(!sameValue(x.a, y.a)) return false;
+	return x.op >= DO_JSR || sameValue(x.b, y.b);
+}
+
+// Decode the whole of memory repeatedly, returning the time taken in ms
+static double timeDecoder(DCPUState& st, DCPUInsn (DCPUState::*decode)(), uint32_t passes, uint32_t& sum) {
+	boost::chrono::high_resolution_clock::time_point start = boost::chrono::high_resolution_clock::now();
+	for(uint32_t p=0;p < passes;p++) {
+		st.info.pc = 0;
+		uint32_t words = 0;
+		while(words < 0x10000) {
+			DCPUInsn insn = (st.*decode)();
+			sum += insn.op + insn.cycleCost + insn.a.nextWord;
+			words += (uint16_t)(insn.nextOffset - insn.offset);
+		}
+	}
+	boost::chrono::duration<double, boost::milli> taken = boost::chrono::high_resolution_clock::now() - start;
+	return taken.count();
+}
+
+int main(int argc, char** argv) {
+	DCPUState st;
+
+	// Check every first word, with distinct words following it
+	uint32_t mismatches = 0;
+	st.info.memory[1] = 0x1234;
+	st.info.memory[2] = 0x5678;
+	for(uint32_t w=0;w < 0x10000;w++) {
+		st.info.memory[0] = (uint16_t)w;
+		st.info.pc = 0;
+		DCPUInsn fast = st.decodeInsn();
+		st.info.pc = 0;
+		DCPUInsn ref = st.decodeInsnReference();
+		if(!sameInsn(fast, ref)) {
+			if(mismatches < 10)
+				fprintf(stderr, "Mismatch decoding 0x%04x\n", w);
+			mismatches++;
+		}
+	}
+	if(mismatches) {
+		fprintf(stderr, "%u of 65536 words decoded differently\n", mismatches);
+		return 1;
+	}
+	printf("All 65536 words decode identically\n");
+
+	// Time both over random code
+	srand(1);
+	for(uint32_t i=0;i < 0x10000;i++)
+		st.info.memory[i] = (uint16_t)rand();
+	uint32_t passes = (argc > 1) ? atoi(argv[1]) : 200;
+	uint32_t sum = 0;
+	double ref = timeDecoder(st, &DCPUState::decodeInsnReference, passes, sum);
+	double fast = timeDecoder(st, &DCPUState::decodeInsn, passes, sum);
+	printf("Reference decoder: %.1fms\n", ref);
+	printf("Table decoder:     %.1fms (%.2fx)\n", fast, ref / fast);
+	return (sum == 0) ? 2 : 0; // Keeps the loops from being optimized out
+}
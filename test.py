@@ -153,6 +153,8 @@ for ctest in testFiles:
 	source = source.text
 	name = name.text
 	cycles = cycles.text
+	options = root.find("options")
+	options = [] if options == None else options.text.split()
 	resultRegs = results.findall("register")
 	resultConstraints = []
 	memoryConstraints = []
@@ -179,6 +181,7 @@ for ctest in testFiles:
 	# Run the test
 	try:
 		params = ["./dcpu", "--test", "--cycles", cycles]
+		params += options
 		if(len(memoryConstraints) > 0):
 			params += ["--test-mem", "--dump-file", os.path.join(assemblyDir, ctest+".memdmp")]
 		params.append(binPth)
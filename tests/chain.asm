@@ -0,0 +1,30 @@
+set a, 0
+:loop
+add a, 1
+add x, 1
+ifn x, 500
+set pc, loop
+
+; The loop block has been chaining to itself. Patch its first instruction to
+; 'add a, 2' and run it again.
+ifn b, 0
+set pc, outer
+set b, 1
+set x, 0
+set [loop], 0x8c02
+set pc, loop
+
+; Once outer has been chained to body, patch body to 'add c, 2' so the
+; chained jump into it has to be undone
+:outer
+add y, 1
+set pc, body
+:body
+add c, 1
+ife y, 2
+set pc, end
+set [body], 0x8c42
+set pc, outer
+
+:end
+set pc, end
@@ -0,0 +1,29 @@
+; Copy and fill loops are run all at once, and have to leave memory and the
+; registers the way running them a word at a time would
+set i, 0x1000
+:fill
+sti [i], 0x55
+ifn i, 0x1010
+set pc, fill
+
+; The copy sees its own stores, repeating the first two words
+set [0x2000], 1
+set [0x2001], 2
+set i, 0x2000
+set j, 0x2002
+:smear
+sti [j], [i]
+ifn i, 0x2020
+set pc, smear
+
+; Fill downwards from a register, stepping with SUB
+set b, 0xbeef
+set c, 0x3010
+:down
+set [c], b
+sub c, 1
+ifn c, 0x3000
+set pc, down
+
+:end
+set pc, end
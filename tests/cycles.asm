@@ -0,0 +1,15 @@
+; Iterations alternate between a failed IF test and a jump out of the middle
+; of the block, so the count that fits in the cycle budget is only right if
+; both paths and every IF in the chain are charged exactly
+:loop
+add a, 1
+ifn a, 0
+ife b, 1
+set pc, odd
+xor b, 1
+set pc, loop
+
+:odd
+add x, 1
+xor b, 1
+set pc, loop
@@ -0,0 +1,38 @@
+; Division and multiplication by literals is done with shifts, masks, and
+; multiplies by a reciprocal. Operands come from memory so nothing can be
+; worked out ahead of time.
+set [0x1000], 12345
+set [0x1001], -12345
+set [0x1002], 0x8000
+set [0x1003], 12346
+
+set a, [0x1000]
+div a, 10
+set [0x2000], ex
+
+set b, [0x1001]
+dvi b, -10
+set [0x2001], ex
+
+set c, [0x1002]
+dvi c, -1
+set [0x2002], ex
+
+dvi [0x1003], -10
+set [0x2004], ex
+
+set x, [0x1000]
+mod x, 16
+
+set y, [0x1001]
+mdi y, 10
+
+set z, [0x1000]
+mul z, 32
+set [0x2003], ex
+
+set i, [0x1001]
+mod i, 7
+
+:loop
+set pc, loop
@@ -0,0 +1,42 @@
+; Overflow values in EX, computed from operands only known at runtime
+set i, data
+
+set ex, 7
+set a, [i]
+add a, 5		; No carry
+set [0x1000], ex
+
+set ex, 7
+set b, [i+1]
+sub b, 5		; No borrow
+set [0x1001], ex
+
+set ex, 7
+set c, [i+2]
+div c, [i+3]	; Dividing by zero also clears EX
+set [0x1002], ex
+
+set ex, 1
+set x, [i+4]
+sbx x, 0		; Overflows
+set [0x1003], ex
+
+set y, [i+5]
+dvi y, -1		; 0x8000 / -1
+set [0x1004], ex
+
+set ex, 3
+set z, [i+4]
+adx z, [i+4]	; Overflows
+set [0x1005], ex
+
+add z, 1		; EX never read before it's overwritten
+shl z, 4
+sub z, 2
+set j, ex
+
+:loop
+set pc, loop
+
+:data
+dat 0xfff0, 0x0010, 0x0003, 0, 0xffff, 0x8000
@@ -0,0 +1,17 @@
+; Constant folding and dead store elimination in compiled blocks
+set a, 5
+add a, 3		; Folds to 8, with no overflow
+set x, ex
+set b, a
+set c, 1		; Overwritten before it's read
+set c, 2
+set [0x1000], a
+set i, 0x1000
+set y, [i]		; Address is known
+sub a, 10		; Underflows
+set z, ex
+ifn b, 8
+	set j, 1
+set pc, done
+:done
+set pc, done
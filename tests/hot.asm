@@ -0,0 +1,22 @@
+; Blocks that run often enough are compiled a second time, around how their
+; tests and indirect jumps went. The second translation has to do exactly
+; what the first did, whichever way things go afterwards.
+set i, 0
+:loop
+ifl i, 0x30		; Passes until late on
+add a, 1
+ife i, 0x38		; Almost never passes
+set b, i
+ifb i, 1		; Goes either way
+sub c, 1
+set z, next
+set pc, z		; Always goes to the same place
+:next
+add i, 1
+ifn i, 0x40
+set pc, loop
+
+; Counts what's left of the budget
+:end
+add j, 1
+set pc, end
@@ -0,0 +1,16 @@
+; Interrupts raised while IA is zero are dropped, and ones raised while
+; queueing is on wait until it's turned off
+int 5
+ias handler
+iaq 1
+int 7
+set x, 1
+iaq 0
+:wait
+set pc, wait
+
+:handler
+set y, x
+set c, a
+add z, 1
+rfi 0
@@ -0,0 +1,22 @@
+; Loops that only poll memory are skipped to the end of the cycle budget. The
+; interrupt queued before the first one is still taken, and the handler's
+; store lets it exit into a second one, which jumps out past a test that
+; never passes.
+ias handler
+iaq 1
+int 3
+iaq 0
+:wait
+ife [0x1000], 0
+set pc, wait
+add a, 1
+:spin
+ifn [0x1001], 0
+set pc, out
+set pc, spin
+
+:out
+set b, 1
+:handler
+set [0x1000], a
+rfi 0
@@ -0,0 +1,33 @@
+; Dispatches through a jump table and a register often enough to be
+; compiled. Each jump cycles through more targets than its cache holds, so
+; hits, misses and refills all happen.
+set i, 0
+:loop
+set z, i
+mod z, 3
+set pc, [table+z]
+:case0
+add a, 1
+set pc, next
+:case1
+add b, 1
+set pc, next
+:case2
+add c, 1
+:next
+set j, after
+ifg i, 100
+	set j, late
+set pc, j
+:late
+add y, 1
+:after
+add i, 1
+ifn i, 150
+	set pc, loop
+
+:done
+set pc, done
+
+:table
+dat case0, case1, case2
@@ -0,0 +1,23 @@
+; Loop bodies that keep their registers in host registers, leaving through
+; both the skip path and the taken jump
+set i, 0
+set j, 0x1000
+set a, 0
+:loop
+sti [j], i
+add a, i
+shl a, 1
+shr a, 1
+set push, a
+add b, peek
+set c, pop
+ife i, 10
+set pc, done
+set pc, loop
+
+:done
+set x, [0x1009]
+shr a, 1
+set y, ex
+:end
+set pc, end
@@ -0,0 +1,45 @@
+; Calls and returns, run often enough to be compiled. Returns are predicted
+; from the shadow stack, which has to fall back on a mismatch: when a
+; subroutine returns somewhere else, and when recursion is deeper than the
+; shadow stack holds.
+set i, 0
+:loop
+jsr inc_a
+jsr inc_a
+jsr skip_return		; Returns past the add below
+add b, 100
+set c, 40
+jsr recurse
+add i, 1
+ifn i, 30
+	set pc, loop
+
+; A jump through a register leaves the block with the registers it changed
+set a, 10
+add a, 3
+set j, target
+ife a, a
+	set pc, j
+set a, 0
+:target
+set x, a
+
+:done
+set pc, done
+
+:inc_a
+add a, 1
+set pc, pop
+
+:skip_return
+add peek, 2		; The add is two words long
+add b, 1
+set pc, pop
+
+:recurse
+ife c, 0
+	set pc, pop
+sub c, 1
+add y, 1
+jsr recurse
+set pc, pop
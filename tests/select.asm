@@ -0,0 +1,27 @@
+; Tests guarding a single SET, ADD, or SUB to a register are compiled
+; without branches. Results and cycle counts have to match either way; the
+; count kept at the end shows whether any cycles went missing.
+set [0x3000], 0x40
+set i, 0
+:loop
+set a, i
+mul a, 7
+ifg a, 0x100
+set a, 0x100
+ifl b, a
+set b, a
+ifu a, 0x80
+add c, 0xfff0
+ife i, 0x30
+sub x, 3
+ifb i, 1
+set y, [0x3000]
+ifc i, 2
+add z, [0x3000]
+add i, 1
+ifn i, 0x40
+set pc, loop
+
+:end
+add j, 1
+set pc, end
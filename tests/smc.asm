@@ -0,0 +1,20 @@
+set b, 0
+set pc, again
+
+:again
+set a, 1
+add b, 1
+ifn b, 2
+set pc, modify
+
+; Overwrite an instruction later in the same block with 'set c, 3'
+set [next], 0x9041
+:next
+set c, 1
+:loop
+set pc, loop
+
+; Rewrite the first instruction of the block to 'set a, 2' and run it again
+:modify
+set [again], 0x8c01
+set pc, again
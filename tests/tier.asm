@@ -0,0 +1,16 @@
+; Runs the loop body often enough for it to move from the interpreter to
+; compiled code, so both tiers have to agree on the results
+set i, 0
+set z, 7
+:loop
+add a, i
+set b, pc		; PC reads see the next instruction
+mul z, 3
+mod z, 0		; Dividing by zero leaves a zero result
+add z, 7
+add i, 1
+ifn i, 40
+	set pc, loop
+
+:done
+set pc, done
@@ -0,0 +1,26 @@
+; Traces run through calls and jumps to literal addresses, and through loop
+; back edges with a side exit for the loop's end
+set pc, start
+:sub
+add a, 1
+set pc, pop
+
+:start
+jsr sub
+jsr sub
+set pc, check
+:body
+add x, 2
+:check
+add i, 1
+ifn i, 10
+set pc, body
+set y, x
+
+; The trace through the call below includes sub, so this store has to drop it
+set [sub], 0x8c02
+jsr sub
+set z, a
+
+:end
+set pc, end
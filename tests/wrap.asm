@@ -0,0 +1,17 @@
+; Register plus offset addresses wrap around the end of memory. The bases
+; are loaded from memory so they can't be folded into the addresses.
+set a, [base]
+set [a+0x50], 5		; Stores to 0x0040
+set b, [0x0040]
+set [0x0041], 7
+set c, [a+0x51]
+add [a+0x51], 1
+set x, [0x0041]
+set i, [base2]
+set y, [i+0x42]		; Reads 0x0041
+:done
+set pc, done
+:base
+dat 0xfff0
+:base2
+dat 0xffff